@@ -4,14 +4,46 @@
 #include <string.h>
 #include <time.h>
 
+/*
+ * Builds with -D_POSIX_C_SOURCE=200112L or later also give page cache hints
+ * for input and output, sleep on a wall clock in replay, and sync files which
+ * others depend on to disk, and read inputs from a directory.  Where
+ * <sys/mman.h> has MADV_HUGEPAGE (glibc with -D_DEFAULT_SOURCE), large
+ * buffers are backed by transparent huge pages.
+ */
+#if defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L
+#define POSIX_2001
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 static const char *err_too_many_args = /**/
     "ERR_TOO_MANY_ARGS";
+static const char *err_unknown_command = /**/
+    "ERR_UNKNOWN_COMMAND";
+static const char *err_unknown_option = /**/
+    "ERR_UNKNOWN_OPTION";
+static const char *err_missing_option_value = /**/
+    "ERR_MISSING_OPTION_VALUE";
+static const char *err_wrong_option_value = /**/
+    "ERR_WRONG_OPTION_VALUE";
 static const char *err_line_is_too_long = /**/
     "ERR_LINE_IS_TOO_LONG";
 static const char *err_wrong_line_format = /**/
     "ERR_WRONG_LINE_FORMAT";
 static const char *err_input_read_error = /**/
     "ERR_INPUT_READ_ERROR";
+static const char *err_input_is_not_seekable = /**/
+    "ERR_INPUT_IS_NOT_SEEKABLE";
+static const char *err_output_write_error = /**/
+    "ERR_OUTPUT_WRITE_ERROR";
+static const char *err_failed_to_open_file = /**/
+    "ERR_FAILED_TO_OPEN_FILE";
+static const char *err_out_of_memory = /**/
+    "ERR_OUT_OF_MEMORY";
 static const char *err_wrong_time_format = /**/
     "ERR_WRONG_TIME_FORMAT";
 static const char *err_time_buffer_size_exceeded = /**/
@@ -20,33 +52,653 @@ static const char *err_failed_to_parse_month = /**/
     "ERR_FAILED_TO_PARSE_MONTH";
 static const char *err_failed_to_parse_apache_datetime = /**/
     "ERR_FAILED_TO_PARSE_APACHE_DATETIME";
+static const char *err_failed_to_parse_duration = /**/
+    "ERR_FAILED_TO_PARSE_DURATION";
+static const char *err_wrong_lookup_line_format = /**/
+    "ERR_WRONG_LOOKUP_LINE_FORMAT";
+static const char *err_wrong_lookup_file = /**/
+    "ERR_WRONG_LOOKUP_FILE";
+static const char *err_too_many_lookups = /**/
+    "ERR_TOO_MANY_LOOKUPS";
+static const char *err_too_many_literals = /**/
+    "ERR_TOO_MANY_LITERALS";
+static const char *err_too_many_filters = /**/
+    "ERR_TOO_MANY_FILTERS";
+static const char *err_wrong_state_file = /**/
+    "ERR_WRONG_STATE_FILE";
+static const char *err_wrong_rollup_manifest = /**/
+    "ERR_WRONG_ROLLUP_MANIFEST";
+static const char *err_steady_state_allocation = /**/
+    "ERR_STEADY_STATE_ALLOCATION";
+static const char *err_wrong_records_file = /**/
+    "ERR_WRONG_RECORDS_FILE";
+static const char *err_truncated_records_file = /**/
+    "ERR_TRUNCATED_RECORDS_FILE";
+static const char *err_wrong_columnar_files = /**/
+    "ERR_WRONG_COLUMNAR_FILES";
+static const char *err_unknown_column = /**/
+    "ERR_UNKNOWN_COLUMN";
+static const char *err_wrong_bloom_file = /**/
+    "ERR_WRONG_BLOOM_FILE";
+static const char *err_wrong_trigram_file = /**/
+    "ERR_WRONG_TRIGRAM_FILE";
+static const char *err_wrong_dictionary_file = /**/
+    "ERR_WRONG_DICTIONARY_FILE";
+static const char *err_wrong_cache_entry = /**/
+    "ERR_WRONG_CACHE_ENTRY";
+
+/*
+ * Output
+ *
+ * Converted rows are collected in a chunk buffer, which is written out with
+ * a single fwrite once it grows over the chunk size, instead of going
+ * through stdio field by field.  The rest is written when a command is over,
+ * and by error(), so rows converted before an error are not lost.
+ */
+
+#define DEFAULT_OUTPUT_CHUNK 4096
+
+static struct output {
+        char *data;
+        size_t len;
+        size_t cap;
+        size_t chunk;
+        unsigned long written;
+        int hold; /* rows are kept until the cluster window is written */
+        FILE *tee; /* cache entry being written */
+        unsigned long drop_behind; /* of --drop-behind */
+        unsigned long dropped; /* bytes written before the last drop */
+} output = {NULL, 0, 0, DEFAULT_OUTPUT_CHUNK, 0, 0, NULL, 0, 0};
 
 static void error(const char *m)
 {
+        /* Not through out_flush(), as its failure calls error() */
+        if (output.len) {
+                fwrite(output.data, 1, output.len, stdout);
+                output.len = 0;
+        }
+        fflush(stdout);
         fprintf(stderr, "Error: %s\n", m);
         exit(EXIT_FAILURE);
 }
 
-static const char *print_non_spaces(const char *s)
+/* Number of heap allocations made, reported by --stats */
+static unsigned long allocations;
+
+static void *xmalloc(size_t size)
+{
+        void *p = malloc(size);
+
+        allocations++;
+        if (!p) {
+                error(err_out_of_memory);
+        }
+        return p;
+}
+
+/*
+ * Buffers of a huge page or more: input and output buffers, lookup tables and
+ * the arena.  They are aligned to huge pages and advised to be backed by them
+ * where the system can, which saves TLB misses when they are megabytes large,
+ * and are freed by free() like the others.
+ */
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/* Bytes of buffers advised to be backed by huge pages, for --stats */
+static unsigned long huge_page_advised;
+
+static void *xmalloc_large(size_t size)
+{
+#ifdef MADV_HUGEPAGE
+        if (size >= HUGE_PAGE_SIZE) {
+                size_t aligned = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+                                 * HUGE_PAGE_SIZE;
+                void *p;
+
+                allocations++;
+                if (posix_memalign(&p, HUGE_PAGE_SIZE, aligned)) {
+                        error(err_out_of_memory);
+                }
+                /* Without transparent huge pages, small pages still work */
+                if (!madvise(p, aligned, MADV_HUGEPAGE)) {
+                        huge_page_advised += aligned;
+                }
+                return p;
+        }
+#endif
+        return xmalloc(size);
+}
+
+static void *xcalloc(size_t count, size_t size)
+{
+        void *p = calloc(count, size);
+
+        allocations++;
+        if (!p) {
+                error(err_out_of_memory);
+        }
+        return p;
+}
+
+static FILE *xfopen(const char *path, const char *mode)
+{
+        FILE *f = fopen(path, mode);
+
+        if (!f) {
+                error(err_failed_to_open_file);
+        }
+        return f;
+}
+
+static void xfclose(FILE *f)
+{
+        if (fclose(f)) {
+                error(err_output_write_error);
+        }
+}
+
+/* Closes a file, which files written later depend on being on disk */
+static void xfclose_synced(FILE *f)
+{
+#ifdef POSIX_2001
+        if (fflush(f) || fsync(fileno(f))) {
+                error(err_output_write_error);
+        }
+#endif
+        xfclose(f);
+}
+
+static long file_size(FILE *in)
+{
+        long size;
+
+        if (fseek(in, 0, SEEK_END) || (size = ftell(in)) < 0) {
+                error(err_input_is_not_seekable);
+        }
+        return size;
+}
+
+static char *xstrdup(const char *s)
+{
+        size_t len = strlen(s) + 1;
+
+        return memcpy(xmalloc(len), s, len);
+}
+
+/*
+ * Arena for transient memory of a line: allocations are bumped from a single
+ * block and released all at once by arena_reset().  When the block runs out,
+ * overflow blocks are taken from the heap and the next reset replaces all of
+ * them with one block large enough, so that after warm-up the loop over input
+ * lines does not allocate from the heap at all.
+ */
+
+#define ARENA_ALIGN 8
+
+struct arena_block {
+        struct arena_block *next;
+        size_t size;
+};
+
+struct arena {
+        char *data;
+        size_t used;
+        size_t cap;
+        struct arena_block *overflow;
+        size_t overflow_size;
+};
+
+static void *arena_alloc(struct arena *a, size_t size)
+{
+        struct arena_block *b;
+
+        size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+        if (a->used + size <= a->cap) {
+                a->used += size;
+                return a->data + a->used - size;
+        }
+        b = xmalloc(sizeof(*b) + ARENA_ALIGN + size);
+        b->next = a->overflow;
+        b->size = size;
+        a->overflow = b;
+        a->overflow_size += size;
+        return (char *)b + sizeof(*b) + ARENA_ALIGN;
+}
+
+static void arena_reset(struct arena *a)
+{
+        if (a->overflow) {
+                size_t cap = (a->cap + a->overflow_size) * 2;
+
+                while (a->overflow) {
+                        struct arena_block *b = a->overflow;
+
+                        a->overflow = b->next;
+                        free(b);
+                }
+                free(a->data);
+                a->data = xmalloc_large(cap);
+                a->cap = cap;
+                a->overflow_size = 0;
+        }
+        a->used = 0;
+}
+
+/* Binary files are little-endian regardless of the host */
+
+static void write_u32(FILE *out, unsigned long v)
+{
+        putc((int)(v & 0xFF), out);
+        putc((int)((v >> 8) & 0xFF), out);
+        putc((int)((v >> 16) & 0xFF), out);
+        putc((int)((v >> 24) & 0xFF), out);
+}
+
+static void write_u16(FILE *out, unsigned v)
+{
+        putc((int)(v & 0xFF), out);
+        putc((int)((v >> 8) & 0xFF), out);
+}
+
+/* Values above 32 bits are kept only where unsigned long is wide enough */
+static void write_u64(FILE *out, unsigned long v)
+{
+        write_u32(out, v & 0xFFFFFFFFUL);
+        write_u32(out, (v >> 16) >> 16);
+}
+
+static void write_i64(FILE *out, long v)
+{
+        unsigned long high = ((unsigned long)v >> 16) >> 16;
+
+        if (v < 0 && sizeof(v) < 8) {
+                high = 0xFFFFFFFFUL;
+        }
+        write_u32(out, (unsigned long)v & 0xFFFFFFFFUL);
+        write_u32(out, high);
+}
+
+static unsigned long read_u32(const unsigned char *p)
+{
+        return (unsigned long)p[0] | (unsigned long)p[1] << 8
+               | (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+static int read_i16(const unsigned char *p)
+{
+        unsigned v = (unsigned)p[0] | (unsigned)p[1] << 8;
+
+        return v & 0x8000 ? (int)v - 0x10000 : (int)v;
+}
+
+static long read_i64(const unsigned char *p)
+{
+        unsigned long low = read_u32(p);
+        unsigned long high = read_u32(p + 4);
+
+        if (sizeof(long) < 8) {
+                return high & 0x80000000UL ? -(long)(~low + 1) : (long)low;
+        }
+        return (long)(low | (high << 16) << 16);
+}
+
+/* Reads a whole file into a single allocated block */
+static unsigned char *read_file(const char *path, size_t *size)
+{
+        FILE *in = xfopen(path, "rb");
+        unsigned char *data;
+        long len;
+
+        if (fseek(in, 0, SEEK_END) || (len = ftell(in)) < 0
+            || fseek(in, 0, SEEK_SET)) {
+                error(err_input_read_error);
+        }
+        *size = (size_t)len;
+        data = xmalloc_large(*size + 1);
+        if (fread(data, 1, *size, in) != *size) {
+                error(err_input_read_error);
+        }
+        fclose(in);
+        return data;
+}
+
+/* Hash table with string keys */
+
+struct map_entry {
+        char *key;
+        void *value;
+};
+
+struct map {
+        struct map_entry *slots;
+        size_t cap;
+        size_t len;
+};
+
+#define HASH_SEED 2166136261UL
+
+static unsigned long hash_update(unsigned long h, const char *s, size_t len)
+{
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                h ^= (unsigned char)s[i];
+                h = (h * 16777619UL) & 0xFFFFFFFFUL;
+        }
+        return h;
+}
+
+static unsigned long hash_bytes(const char *s, size_t len)
+{
+        return hash_update(HASH_SEED, s, len);
+}
+
+static struct map_entry *map_slot(const struct map *m, const char *key)
+{
+        size_t i = hash_bytes(key, strlen(key)) & (m->cap - 1);
+
+        while (m->slots[i].key && strcmp(m->slots[i].key, key)) {
+                i = (i + 1) & (m->cap - 1);
+        }
+        return &m->slots[i];
+}
+
+static void *map_get(const struct map *m, const char *key)
+{
+        if (!m->cap) {
+                return NULL;
+        }
+        return map_slot(m, key)->value;
+}
+
+/* Takes ownership of key, which must not be present in the map yet */
+static void map_put(struct map *m, char *key, void *value)
+{
+        struct map_entry *e;
+
+        if ((m->len + 1) * 4 > m->cap * 3) {
+                struct map old = *m;
+                size_t i;
+
+                m->cap = old.cap ? old.cap * 2 : 64;
+                m->slots = xcalloc(m->cap, sizeof(*m->slots));
+                for (i = 0; i < old.cap; i++) {
+                        if (old.slots[i].key) {
+                                *map_slot(m, old.slots[i].key) = old.slots[i];
+                        }
+                }
+                free(old.slots);
+        }
+        e = map_slot(m, key);
+        e->key = key;
+        e->value = value;
+        m->len++;
+}
+
+static int compare_entry_keys(const void *a, const void *b)
+{
+        return strcmp(((const struct map_entry *)a)->key,
+                      ((const struct map_entry *)b)->key);
+}
+
+/* Returns a newly allocated array of map->len entries, sorted by key */
+static struct map_entry *map_sorted(const struct map *m)
+{
+        struct map_entry *entries = xcalloc(m->len + 1, sizeof(*entries));
+        size_t i, n = 0;
+
+        for (i = 0; i < m->cap; i++) {
+                if (m->slots[i].key) {
+                        entries[n++] = m->slots[i];
+                }
+        }
+        qsort(entries, n, sizeof(*entries), compare_entry_keys);
+        return entries;
+}
+
+/*
+ * Log-linear histogram of microsecond values, HDR style: values below
+ * HIST_SUB are counted exactly, every following power of two is split into
+ * HIST_SUB linear sub-buckets, which keeps relative error under 1/HIST_SUB.
+ * Values from 2^HIST_MAX_EXP on are clamped into the last bucket.  Being a
+ * fixed-size array, two histograms merge by adding up their counts.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 31
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+        unsigned long count;
+        unsigned long max;
+        unsigned long buckets[HIST_BUCKETS];
+};
+
+static unsigned hist_bucket(unsigned long v)
+{
+        unsigned e = HIST_SUB_BITS;
+
+        if (v < HIST_SUB) {
+                return (unsigned)v;
+        }
+        while (e < HIST_MAX_EXP && v >> (e + 1)) {
+                e++;
+        }
+        if (e == HIST_MAX_EXP) {
+                return HIST_BUCKETS - 1;
+        }
+        return (e - HIST_SUB_BITS + 1) * HIST_SUB
+               + (unsigned)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Highest value that is counted by the bucket b */
+static unsigned long hist_bucket_top(unsigned b)
+{
+        unsigned e;
+        unsigned long sub;
+
+        if (b < HIST_SUB) {
+                return b;
+        }
+        e = b / HIST_SUB + HIST_SUB_BITS - 1;
+        sub = b % HIST_SUB + HIST_SUB;
+        return ((sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_add(struct histogram *h, unsigned long v)
+{
+        h->buckets[hist_bucket(v)]++;
+        h->count++;
+        if (v > h->max) {
+                h->max = v;
+        }
+}
+
+static void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+        unsigned b;
+
+        for (b = 0; b < HIST_BUCKETS; b++) {
+                dst->buckets[b] += src->buckets[b];
+        }
+        dst->count += src->count;
+        if (src->max > dst->max) {
+                dst->max = src->max;
+        }
+}
+
+static unsigned long hist_percentile(const struct histogram *h, unsigned pct)
 {
-        for (; !isspace(*s) && *s != '\0'; s++) {
-                putchar(*s);
+        unsigned long rank = (h->count * pct + 99) / 100;
+        unsigned long seen = 0;
+        unsigned b;
+
+        for (b = 0; b < HIST_BUCKETS; b++) {
+                seen += h->buckets[b];
+                if (seen >= rank && seen) {
+                        break;
+                }
         }
+        if (b == HIST_BUCKETS) {
+                return 0;
+        }
+        return hist_bucket_top(b) < h->max ? hist_bucket_top(b) : h->max;
+}
+
+/* Parsed line */
+
+enum field {
+        FIELD_HOST,
+        FIELD_IDENTITY,
+        FIELD_USER,
+        FIELD_TIME,
+        FIELD_REQUEST,
+        FIELD_STATUS,
+        FIELD_BYTES,
+        FIELD_REFERRER,
+        FIELD_AGENT,
+        FIELD_DURATION,
+        FIELD_COUNT,
+        FIELD_PATH = FIELD_COUNT /* derived from the request line */
+};
+
+static const char *const field_names[] = {
+    "host",
+    "identity",
+    "user",
+    "time",
+    "request",
+    "status",
+    "bytes",
+    "referrer",
+    "agent",
+    "duration",
+    "path",
+};
+
+struct span {
+        const char *ptr;
+        size_t len;
+};
+
+#define MAX_LOOKUPS 8
+#define MAX_LITERALS 16
+#define MAX_FILTERS 8
+#define MAX_COLUMNS 32
+
+/* Output columns besides parsed fields */
+enum column {
+        COLUMN_ERRORS = FIELD_PATH + 1,
+        COLUMN_LINE, /* number of the line in input */
+        COLUMN_LOOKUP /* + index of the lookup */
+};
+
+/* Equality of a parsed field to a value */
+struct filter {
+        int field;
+        const char *value;
+};
+
+/* Key-value table prebuilt by build-lookup, see lookup_build() */
+struct lookup {
+        const char *name;
+        int field;
+        unsigned char *data;
+        unsigned long slots;
+        const unsigned char *heap;
+        size_t heap_size;
+        int used; /* joined only if one of the columns */
+};
+
+struct record {
+        struct span fields[FIELD_COUNT];
+        struct tm time;
+        int gmt_offset;
+        unsigned long duration_us;
+        struct span errors;
+        struct span lookups[MAX_LOOKUPS];
+        unsigned long line;
+};
+
+enum duration_format {
+        DURATION_NONE,
+        DURATION_MICROSECONDS, /* %D */
+        DURATION_SECONDS       /* %T */
+};
+
+struct options {
+        enum duration_format duration;
+        const char *latency_path;
+        const char *state_path;
+        const char *rollup_dir;
+        const char *errors_path;
+        int errors_used;
+        long error_window;
+        struct lookup lookups[MAX_LOOKUPS];
+        size_t lookups_count;
+        const char *input_path;
+        size_t input_buffer;
+        size_t drop_behind;
+        long range_start;
+        long range_end; /* -1 for the end of input */
+        int stats;
+        int strict_alloc;
+        const char *literals[MAX_LITERALS];
+        size_t literals_count;
+        struct filter filters[MAX_FILTERS];
+        size_t filters_count;
+        int has_from;
+        int has_to;
+        long from; /* wall clock seconds, inclusive */
+        long to;   /* wall clock seconds, exclusive */
+        int sorted;
+        const char *columns_spec;
+        int columns[MAX_COLUMNS];
+        size_t columns_count;
+        const char *columnar_prefix;
+        const char *records_path;
+        const char *bloom_path;
+        int trigrams;
+        int encode;
+        const char *dictionary_path;
+        const char *cache_dir;
+        int cache_verify;
+        const char *inputs_path;
+        const char *inputs_dir;
+        const char *inputs_match;
+        int has_modified_since;
+        long modified_since; /* wall clock seconds in UTC */
+        int cluster_fields[MAX_COLUMNS];
+        size_t cluster_count;
+        unsigned long cluster_window;
+        double bloom_fpr;
+        unsigned long bloom_size;
+};
+
+static const char *scan_non_spaces(const char *s, struct span *f)
+{
+        f->ptr = s;
+        for (; !isspace(*s) && *s != '\0'; s++)
+                ;
+        f->len = (size_t)(s - f->ptr);
         return s;
 }
 
-static const char *print_enclosed(const char *s, const char op, const char end)
+static const char *
+scan_enclosed(const char *s, const char op, const char end, struct span *f)
 {
         if (*s != op) {
                 error(err_wrong_line_format);
         }
         s++;
-        for (; *s != end && *s != '\0'; s++) {
-                putchar(*s);
-        }
+        f->ptr = s;
+        for (; *s != end && *s != '\0'; s++)
+                ;
         if (*s != end) {
                 error(err_wrong_line_format);
         }
+        f->len = (size_t)(s - f->ptr);
         s++;
         return s;
 }
@@ -110,125 +762,5239 @@ parse_apache_datetime(const char *s, struct tm *time, int *gmt_offset)
         return s + chars_read;
 }
 
-static const char *print_timestamp_as_iso(const char *s)
+/* Days since 1970-01-01 in the proleptic Gregorian calendar */
+static long days_from_civil(long y, int m, int d)
 {
-        static const char *fmt_iso = "%Y-%m-%dT%H:%M:%S";
+        long era, yoe, doy;
 
-        char dt_buf[32] = {0};
-        struct tm time = {0};
-        int gmt_offset = 0;
+        y -= m <= 2;
+        era = (y >= 0 ? y : y - 399) / 400;
+        yoe = y - era * 400;
+        doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+        return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
 
+/* Seconds since epoch of the wall clock time, ignoring any time zone */
+static long tm_to_seconds(const struct tm *t)
+{
+        long days = days_from_civil(
+            t->tm_year + 1900L, t->tm_mon + 1, t->tm_mday);
+
+        return days * 86400L + t->tm_hour * 3600L + t->tm_min * 60L
+               + t->tm_sec;
+}
+
+static const char *scan_timestamp(const char *s, struct record *r)
+{
         if (*s != '[') {
                 error(err_wrong_line_format);
         }
         s++;
-        s = parse_apache_datetime(s, &time, &gmt_offset);
+        r->fields[FIELD_TIME].ptr = s;
+        s = parse_apache_datetime(s, &r->time, &r->gmt_offset);
         if (!s) {
                 error(err_wrong_time_format);
         }
         if (*s != ']') {
                 error(err_wrong_line_format);
         }
+        r->fields[FIELD_TIME].len = (size_t)(s - r->fields[FIELD_TIME].ptr);
         s++;
-        if (!strftime(dt_buf, sizeof(dt_buf), fmt_iso, &time)) {
-                error(err_time_buffer_size_exceeded);
+        return s;
+}
+
+/* Format of the trailing duration field of --duration */
+static enum duration_format parse_duration_format(const char *s)
+{
+        if (!strcmp(s, "%D")) {
+                return DURATION_MICROSECONDS;
         }
-        printf("%s", dt_buf);
-        if (gmt_offset >= 0) {
-                printf("+%04d", gmt_offset);
-        } else {
-                printf("%05d", gmt_offset);
+        if (!strcmp(s, "%T")) {
+                return DURATION_SECONDS;
         }
+        error(err_wrong_option_value);
+        return DURATION_NONE;
+}
 
+static const char *
+scan_duration(const char *s, enum duration_format fmt, struct record *r)
+{
+        struct span *f = &r->fields[FIELD_DURATION];
+        unsigned long v = 0;
+        const char *p;
+
+        s = scan_non_spaces(s, f);
+        if (!f->len) {
+                error(err_failed_to_parse_duration);
+        }
+        for (p = f->ptr; p < s; p++) {
+                if (!isdigit(*p)) {
+                        error(err_failed_to_parse_duration);
+                }
+                v = v * 10 + (unsigned long)(*p - '0');
+        }
+        r->duration_us = fmt == DURATION_SECONDS ? v * 1000000UL : v;
         return s;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Pre-filter on raw lines, so lines without any of the literals never reach
+ * the parser.  memchr() for the first byte lets the C library scan with
+ * whatever vector instructions it has, memcmp() confirms candidates.
+ */
+static int contains_any(const char *line, size_t len, const struct options *o)
 {
-        char in_buf[4096] = {0};
-        const char *s = NULL;
+        const char *end = line + len;
+        size_t i;
 
-        (void)**argv;
+        for (i = 0; i < o->literals_count; i++) {
+                const char *lit = o->literals[i];
+                size_t lit_len = strlen(lit);
+                const char *p = line;
 
-        if (argc > 1) {
-                error(err_too_many_args);
+                while (lit_len <= (size_t)(end - p)
+                       && (p = memchr(
+                               p, *lit, (size_t)(end - p) - lit_len + 1))) {
+                        if (!memcmp(p, lit, lit_len)) {
+                                return 1;
+                        }
+                        p++;
+                }
         }
+        return 0;
+}
+
+static void parse_line(const char *s, const struct options *o, struct record *r)
+{
+        /* Common Log Format fields from Apache*/
 
-        printf("host\t"
-               "identity\t"
-               "user\t"
-               "time\t"
-               "request\t"
-               "status\t"
-               "bytes\t"
-               "referrer\t"
-               "agent\n");
+        /* (%h) host */
+        s = scan_non_spaces(s, &r->fields[FIELD_HOST]);
+        s = skip_spaces(s);
 
-        while (fgets(in_buf, sizeof(in_buf), stdin)) {
-                if (!memchr(in_buf, '\n', sizeof(in_buf))) {
-                        error(err_line_is_too_long);
-                }
+        /* (%l) identity */
+        s = scan_non_spaces(s, &r->fields[FIELD_IDENTITY]);
+        s = skip_spaces(s);
 
-                s = in_buf;
-                if (*s == '\n') {
-                        putchar('\n');
-                        continue;
-                }
+        /* (%u) user */
+        s = scan_non_spaces(s, &r->fields[FIELD_USER]);
+        s = skip_spaces(s);
 
-                /* Common Log Format fields from Apache*/
+        /* (%t) time */
+        s = scan_timestamp(s, r);
+        s = skip_spaces(s);
 
-                /* (%h) host */
-                s = print_non_spaces(s);
-                s = skip_spaces(s);
-                putchar('\t');
+        /* ("%r") request line */
+        s = scan_enclosed(s, '"', '"', &r->fields[FIELD_REQUEST]);
+        s = skip_spaces(s);
 
-                /* (%l) identity */
-                s = print_non_spaces(s);
-                s = skip_spaces(s);
-                putchar('\t');
+        /* (%s) status code */
+        s = scan_non_spaces(s, &r->fields[FIELD_STATUS]);
+        s = skip_spaces(s);
 
-                /* (%u) user */
-                s = print_non_spaces(s);
-                s = skip_spaces(s);
-                putchar('\t');
+        /* (%b) bytes sent */
+        s = scan_non_spaces(s, &r->fields[FIELD_BYTES]);
+        s = skip_spaces(s);
 
-                /* (%t) time */
-                s = print_timestamp_as_iso(s);
-                s = skip_spaces(s);
-                putchar('\t');
+        /* additional fields in Apache Combined Log Format */
 
-                /* ("%r") request line */
-                s = print_enclosed(s, '"', '"');
-                s = skip_spaces(s);
-                putchar('\t');
+        /* ("%{Referrer}i") referrer */
+        s = scan_enclosed(s, '"', '"', &r->fields[FIELD_REFERRER]);
+        s = skip_spaces(s);
 
-                /* (%s) status code */
-                s = print_non_spaces(s);
-                s = skip_spaces(s);
-                putchar('\t');
+        /* ("%{User-agent}i") user-agent */
+        s = scan_enclosed(s, '"', '"', &r->fields[FIELD_AGENT]);
 
-                /* (%b) bytes sent */
-                s = print_non_spaces(s);
+        /* (%D or %T) time taken to serve the request */
+        if (o->duration != DURATION_NONE) {
+                if (*s != ' ') {
+                        error(err_wrong_line_format);
+                }
                 s = skip_spaces(s);
-                putchar('\t');
+                s = scan_duration(s, o->duration, r);
+        } else {
+                r->fields[FIELD_DURATION].ptr = NULL;
+                r->fields[FIELD_DURATION].len = 0;
+        }
 
-                /* additional fields in Apache Combined Log Format */
+        if (*s != '\n') {
+                error(err_wrong_line_format);
+        }
+}
 
-                /* ("%{Referrer}i") referrer */
-                s = print_enclosed(s, '"', '"');
-                s = skip_spaces(s);
-                putchar('\t');
+/* Request path without the method, query string and protocol */
+static struct span path_of_request(const struct span *req)
+{
+        const char *end = req->ptr + req->len;
+        const char *p = memchr(req->ptr, ' ', req->len);
+        struct span path;
 
-                /* ("%{User-agent}i") user-agent */
-                s = print_enclosed(s, '"', '"');
-                if (*s != '\n') {
-                        error(err_wrong_line_format);
+        if (!p) {
+                path.ptr = "-";
+                path.len = 1;
+                return path;
+        }
+        path.ptr = p + 1;
+        for (p = path.ptr; p < end && *p != ' ' && *p != '?'; p++)
+                ;
+        path.len = (size_t)(p - path.ptr);
+        return path;
+}
+
+static struct span request_path(const struct record *r)
+{
+        return path_of_request(&r->fields[FIELD_REQUEST]);
+}
+
+static int field_by_name(const char *name)
+{
+        int i;
+
+        for (i = 0; i <= FIELD_PATH; i++) {
+                if (!strcmp(field_names[i], name)) {
+                        return i;
                 }
-                putchar('\n');
         }
+        error(err_wrong_option_value);
+        return -1;
+}
 
-        if (!feof(stdin)) {
-                error(err_input_read_error);
+static struct span record_field(const struct record *r, int field)
+{
+        return field == FIELD_PATH ? request_path(r) : r->fields[field];
+}
+
+/*
+ * Filters are checked right after parsing, before anything is joined,
+ * formatted or aggregated for a line.
+ */
+
+static int time_in_bounds(long t, const struct options *o)
+{
+        return (!o->has_from || t >= o->from) && (!o->has_to || t < o->to);
+}
+
+static int record_matches(const struct record *r, const struct options *o)
+{
+        size_t i;
+
+        for (i = 0; i < o->filters_count; i++) {
+                struct span f = record_field(r, o->filters[i].field);
+
+                if (strlen(o->filters[i].value) != f.len
+                    || memcmp(o->filters[i].value, f.ptr, f.len)) {
+                        return 0;
+                }
+        }
+        return !(o->has_from || o->has_to)
+               || time_in_bounds(tm_to_seconds(&r->time), o);
+}
+
+/* Parses YYYY-MM-DD with optional THH:MM:SS into wall clock seconds */
+static long parse_iso_datetime(const char *s)
+{
+        struct tm t = {0};
+        int chars_read = 0;
+        int args_read = sscanf(s,
+                               "%4d-%2d-%2d%n",
+                               &t.tm_year,
+                               &t.tm_mon,
+                               &t.tm_mday,
+                               &chars_read);
+
+        if (args_read != 3) {
+                error(err_wrong_option_value);
+        }
+        s += chars_read;
+        if (*s) {
+                chars_read = 0;
+                args_read = sscanf(s,
+                                   "T%2d:%2d:%2d%n",
+                                   &t.tm_hour,
+                                   &t.tm_min,
+                                   &t.tm_sec,
+                                   &chars_read);
+                if (args_read != 3 || s[chars_read]) {
+                        error(err_wrong_option_value);
+                }
+        }
+        t.tm_year -= 1900;
+        t.tm_mon -= 1;
+        return tm_to_seconds(&t);
+}
+
+static void parse_filter(const char *s, struct filter *f)
+{
+        char *name = xstrdup(s);
+        char *value = strchr(name, '=');
+
+        if (!value) {
+                error(err_wrong_option_value);
+        }
+        *value++ = '\0';
+        f->field = field_by_name(name);
+        f->value = value;
+        /* Compared raw, they would not match the formatted columns */
+        if (f->field == FIELD_TIME || f->field == FIELD_DURATION) {
+                error(err_wrong_option_value);
+        }
+}
+
+/*
+ * Lets the kernel evict pages of output written so far, once they are on
+ * disk, so that archive jobs do not fill the page cache with them.  Output,
+ * which is not a file, is left alone by the kernel.
+ */
+static void out_drop(void)
+{
+        if (fflush(stdout)) {
+                error(err_output_write_error);
+        }
+#ifdef POSIX_2001
+        fsync(fileno(stdout));
+        posix_fadvise(fileno(stdout), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        output.dropped = output.written;
+}
+
+static void out_flush(void)
+{
+        size_t len = output.len;
+
+        if (!len) {
+                return;
+        }
+        output.len = 0;
+        if (fwrite(output.data, 1, len, stdout) != len
+            || (output.tee && fwrite(output.data, 1, len, output.tee) != len)) {
+                error(err_output_write_error);
+        }
+        output.written += len;
+        if (output.drop_behind
+            && output.written - output.dropped >= output.drop_behind) {
+                out_drop();
+        }
+}
+
+/* Writes out the rest once a command is over */
+static void out_finish(void)
+{
+        out_flush();
+        if (fflush(stdout)) {
+                error(err_output_write_error);
+        }
+        if (output.drop_behind) {
+                out_drop();
+        }
+}
+
+static void out_bytes(const char *p, size_t n)
+{
+        if (output.len + n > output.cap) {
+                char *data;
+
+                output.cap = (output.len + n) * 2;
+                if (output.cap < output.chunk * 2) {
+                        output.cap = output.chunk * 2;
+                }
+                data = xmalloc_large(output.cap);
+                memcpy(data, output.data ? output.data : "", output.len);
+                free(output.data);
+                output.data = data;
+        }
+        memcpy(output.data + output.len, p, n);
+        output.len += n;
+}
+
+static void out_str(const char *s)
+{
+        out_bytes(s, strlen(s));
+}
+
+static void out_char(char c)
+{
+        out_bytes(&c, 1);
+}
+
+static void out_end_line(void)
+{
+        out_char('\n');
+        if (!output.hold && output.len >= output.chunk) {
+                out_flush();
+        }
+}
+
+static void print_span(const struct span *f)
+{
+        out_bytes(f->ptr, f->len);
+}
+
+static void print_timestamp_as_iso(const struct record *r)
+{
+        static const char *fmt_iso = "%Y-%m-%dT%H:%M:%S";
+
+        char dt_buf[32] = {0};
+        size_t len = strftime(dt_buf, sizeof(dt_buf), fmt_iso, &r->time);
+
+        if (!len || len + 6 > sizeof(dt_buf)) {
+                error(err_time_buffer_size_exceeded);
+        }
+        if (r->gmt_offset >= 0) {
+                sprintf(dt_buf + len, "+%04d", r->gmt_offset);
+        } else {
+                sprintf(dt_buf + len, "%05d", r->gmt_offset);
+        }
+        out_str(dt_buf);
+}
+
+static const char *column_name(int column, const struct options *o)
+{
+        if (column >= COLUMN_LOOKUP) {
+                return o->lookups[column - COLUMN_LOOKUP].name;
+        }
+        if (column == COLUMN_LINE) {
+                return "line";
+        }
+        return column == COLUMN_ERRORS ? "errors" : field_names[column];
+}
+
+static void print_header(const struct options *o)
+{
+        size_t i;
+
+        for (i = 0; i < o->columns_count; i++) {
+                if (i) {
+                        out_char('\t');
+                }
+                out_str(column_name(o->columns[i], o));
+        }
+        out_end_line();
+}
+
+static void print_record(const struct record *r, const struct options *o)
+{
+        char num_buf[32];
+        struct span f;
+        size_t i;
+
+        for (i = 0; i < o->columns_count; i++) {
+                int column = o->columns[i];
+
+                if (i) {
+                        out_char('\t');
+                }
+                if (column >= COLUMN_LOOKUP) {
+                        print_span(&r->lookups[column - COLUMN_LOOKUP]);
+                } else if (column == COLUMN_ERRORS) {
+                        print_span(&r->errors);
+                } else if (column == FIELD_TIME) {
+                        print_timestamp_as_iso(r);
+                } else if (column == FIELD_DURATION) {
+                        sprintf(num_buf, "%lu", r->duration_us);
+                        out_str(num_buf);
+                } else if (column == COLUMN_LINE) {
+                        sprintf(num_buf, "%lu", r->line);
+                        out_str(num_buf);
+                } else {
+                        f = record_field(r, column);
+                        print_span(&f);
+                }
+        }
+        out_end_line();
+}
+
+/*
+ * Trigram index of request paths in columnar output, PREFIX.trigrams.bin:
+ *
+ *   "ALTG", version, number of blocks, number of trigrams (u32 each)
+ *   directory sorted by trigram: trigram, offset of postings relative to
+ *   the end of directory, number of postings (u32 each)
+ *   postings: block numbers in ascending order, each one as a varint of
+ *   the difference to the previous one
+ *
+ * Blocks are those of the zone map.  A bitmap of all 2^24 trigrams tells
+ * which were already seen in the current block, so indexing costs a bit test
+ * per byte of path.
+ */
+
+#define TRIGRAM_VERSION 1
+#define TRIGRAM_HEADER_SIZE 16
+#define TRIGRAM_ENTRY_SIZE 12
+#define TRIGRAM_COUNT (1UL << 24)
+
+struct posting {
+        unsigned long trigram;
+        unsigned long block;
+};
+
+struct trigrams {
+        unsigned char *seen;
+        unsigned long *block_trigrams;
+        size_t block_len;
+        size_t block_cap;
+        struct posting *postings;
+        size_t len;
+        size_t cap;
+        unsigned long blocks;
+};
+
+static unsigned long trigram_at(const char *p)
+{
+        return (unsigned long)(unsigned char)p[0] << 16
+               | (unsigned long)(unsigned char)p[1] << 8
+               | (unsigned long)(unsigned char)p[2];
+}
+
+/* Like realloc, but counted as an allocation */
+static void *grow_copy(void *p, size_t *cap, size_t len, size_t size)
+{
+        void *q;
+
+        if (len < *cap) {
+                return p;
+        }
+        *cap = *cap ? *cap * 2 : 256;
+        q = xmalloc(*cap * size);
+        if (p) {
+                memcpy(q, p, len * size);
+                free(p);
+        }
+        return q;
+}
+
+static void trigrams_add(struct trigrams *t, struct span path)
+{
+        size_t i;
+
+        for (i = 0; i + 3 <= path.len; i++) {
+                unsigned long g = trigram_at(path.ptr + i);
+                unsigned char bit = (unsigned char)(1 << (g % 8));
+
+                if (!(t->seen[g / 8] & bit)) {
+                        t->seen[g / 8] |= bit;
+                        t->block_trigrams = grow_copy(t->block_trigrams,
+                                                      &t->block_cap,
+                                                      t->block_len,
+                                                      sizeof(unsigned long));
+                        t->block_trigrams[t->block_len++] = g;
+                }
+        }
+}
+
+static void trigrams_end_block(struct trigrams *t)
+{
+        size_t i;
+
+        for (i = 0; i < t->block_len; i++) {
+                unsigned long g = t->block_trigrams[i];
+
+                t->seen[g / 8] = 0;
+                t->postings = grow_copy(t->postings,
+                                        &t->cap,
+                                        t->len,
+                                        sizeof(*t->postings));
+                t->postings[t->len].trigram = g;
+                t->postings[t->len].block = t->blocks;
+                t->len++;
+        }
+        t->block_len = 0;
+        t->blocks++;
+}
+
+static int compare_postings(const void *a, const void *b)
+{
+        const struct posting *x = a;
+        const struct posting *y = b;
+
+        if (x->trigram != y->trigram) {
+                return x->trigram < y->trigram ? -1 : 1;
+        }
+        return x->block < y->block ? -1 : x->block > y->block;
+}
+
+static void write_varint(FILE *out, unsigned long v)
+{
+        while (v >= 0x80) {
+                putc((int)(v & 0x7F) | 0x80, out);
+                v >>= 7;
+        }
+        putc((int)v, out);
+}
+
+static unsigned long varint_size(unsigned long v)
+{
+        unsigned long n = 1;
+
+        while (v >= 0x80) {
+                v >>= 7;
+                n++;
+        }
+        return n;
+}
+
+/* Whether posting i is the first one of its trigram */
+static int posting_first(const struct trigrams *t, size_t i)
+{
+        return !i || t->postings[i].trigram != t->postings[i - 1].trigram;
+}
+
+/* Difference of the block of posting i to the previous one of its trigram */
+static unsigned long posting_delta(const struct trigrams *t, size_t i)
+{
+        if (posting_first(t, i)) {
+                return t->postings[i].block;
+        }
+        return t->postings[i].block - t->postings[i - 1].block;
+}
+
+static void trigrams_write(struct trigrams *t, FILE *out)
+{
+        unsigned long count = 0, offset = 0;
+        size_t i, j;
+
+        qsort(t->postings, t->len, sizeof(*t->postings), compare_postings);
+        for (i = 0; i < t->len; i++) {
+                if (posting_first(t, i)) {
+                        count++;
+                }
+        }
+        fwrite("ALTG", 1, 4, out);
+        write_u32(out, TRIGRAM_VERSION);
+        write_u32(out, t->blocks);
+        write_u32(out, count);
+        for (i = 0; i < t->len; i = j) {
+                write_u32(out, t->postings[i].trigram);
+                write_u32(out, offset);
+                for (j = i; j < t->len
+                            && t->postings[j].trigram == t->postings[i].trigram;
+                     j++) {
+                        offset += varint_size(posting_delta(t, j));
+                }
+                write_u32(out, (unsigned long)(j - i));
+        }
+        for (i = 0; i < t->len; i++) {
+                write_varint(out, posting_delta(t, i));
+        }
+}
+
+/*
+ * Global string dictionary, shared by runs so that string IDs are stable
+ * across days:
+ *
+ *   "ALTD", version, number of strings (u32 each)
+ *   strings in the order of their IDs: length (u32), bytes
+ *
+ * Strings are only appended, and the number in the header is updated after
+ * them, so readers see a consistent dictionary without locking.  Writers
+ * take turns: in POSIX builds, a writer holds a lock on the file from before
+ * it reads the strings until it closes it, others must not write at the same
+ * time.  Strings left past the counted ones by a writer which did not finish
+ * are overwritten by the next one.
+ */
+
+#define DICTIONARY_VERSION 1
+#define DICTIONARY_HEADER_SIZE 12
+
+struct dictionary {
+        FILE *f;
+        int writable;
+        unsigned long count;
+        struct map ids; /* of writers only */
+        char *heap; /* strings with terminating '\0' */
+        size_t heap_len;
+        size_t heap_cap;
+        unsigned long *offsets; /* of readers only, count + 1 entries */
+        char *key;
+        size_t key_cap;
+};
+
+static void dictionary_index(struct dictionary *d, const char *s)
+{
+        unsigned long *id = xmalloc(sizeof(*id));
+
+        *id = d->count;
+        map_put(&d->ids, xstrdup(s), id);
+}
+
+/* Waits for the turn of the writer, till the file is closed */
+static void dictionary_lock(FILE *f)
+{
+#ifdef POSIX_2001
+        struct flock lock;
+
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        if (fcntl(fileno(f), F_SETLKW, &lock) == -1) {
+                error(err_failed_to_open_file);
+        }
+#else
+        (void)f;
+#endif
+}
+
+static void
+dictionary_open(struct dictionary *d, const char *path, int writable)
+{
+        unsigned char head[DICTIONARY_HEADER_SIZE];
+        unsigned char len_buf[4];
+        unsigned long i, count;
+        size_t len;
+
+        memset(d, 0, sizeof(*d));
+        d->writable = writable;
+        if (writable) {
+                /* Created if missing, without truncating one in use */
+                xfclose(xfopen(path, "ab"));
+        }
+        d->f = xfopen(path, writable ? "r+b" : "rb");
+        if (writable) {
+                dictionary_lock(d->f);
+                if (!file_size(d->f)) {
+                        fwrite("ALTD", 1, 4, d->f);
+                        write_u32(d->f, DICTIONARY_VERSION);
+                        write_u32(d->f, 0);
+                        return;
+                }
+                rewind(d->f);
+        }
+        if (fread(head, 1, sizeof(head), d->f) != sizeof(head)
+            || memcmp(head, "ALTD", 4)
+            || read_u32(head + 4) != DICTIONARY_VERSION) {
+                error(err_wrong_dictionary_file);
+        }
+        count = read_u32(head + 8);
+        if (!writable) {
+                d->offsets = xmalloc((count + 1) * sizeof(*d->offsets));
+        }
+        for (i = 0; i < count; i++) {
+                if (fread(len_buf, 1, 4, d->f) != 4) {
+                        error(err_wrong_dictionary_file);
+                }
+                len = read_u32(len_buf);
+                if (d->heap_len + len + 1 > d->heap_cap) {
+                        char *heap;
+
+                        d->heap_cap = (d->heap_len + len + 1) * 2;
+                        heap = xmalloc(d->heap_cap);
+                        memcpy(heap, d->heap ? d->heap : "", d->heap_len);
+                        free(d->heap);
+                        d->heap = heap;
+                }
+                if (fread(d->heap + d->heap_len, 1, len, d->f) != len) {
+                        error(err_wrong_dictionary_file);
+                }
+                d->heap[d->heap_len + len] = '\0';
+                if (writable) {
+                        dictionary_index(d, d->heap + d->heap_len);
+                } else {
+                        d->offsets[i] = d->heap_len;
+                }
+                d->count++;
+                d->heap_len += len + 1;
+        }
+        if (!writable) {
+                d->offsets[count] = d->heap_len;
+        } else if (fseek(d->f, ftell(d->f), SEEK_SET)) {
+                /* New strings follow the counted ones, written in order */
+                error(err_output_write_error);
+        }
+}
+
+/* ID of the string, which is appended if it is new */
+static unsigned long dictionary_id(struct dictionary *d, struct span s)
+{
+        unsigned long *id;
+
+        if (s.len + 1 > d->key_cap) {
+                free(d->key);
+                d->key_cap = (s.len + 1) * 2;
+                d->key = xmalloc(d->key_cap);
+        }
+        memcpy(d->key, s.ptr, s.len);
+        d->key[s.len] = '\0';
+        id = map_get(&d->ids, d->key);
+        if (id) {
+                return *id;
+        }
+        write_u32(d->f, (unsigned long)s.len);
+        fwrite(s.ptr, 1, s.len, d->f);
+        dictionary_index(d, d->key);
+        return d->count++;
+}
+
+static struct span dictionary_string(const struct dictionary *d,
+                                     unsigned long id)
+{
+        struct span s;
+
+        if (id >= d->count) {
+                error(err_wrong_dictionary_file);
+        }
+        s.ptr = d->heap + d->offsets[id];
+        s.len = d->offsets[id + 1] - d->offsets[id] - 1;
+        return s;
+}
+
+/* ID of the string for readers, or the number of strings if it is absent */
+static unsigned long dictionary_find(const struct dictionary *d, const char *s)
+{
+        size_t len = strlen(s);
+        unsigned long id;
+
+        for (id = 0; id < d->count; id++) {
+                if (d->offsets[id + 1] - d->offsets[id] - 1 == len
+                    && !memcmp(d->heap + d->offsets[id], s, len)) {
+                        break;
+                }
+        }
+        return id;
+}
+
+/* Strings are flushed before the header counts them */
+static void dictionary_close(struct dictionary *d)
+{
+        if (fflush(d->f) || fseek(d->f, 8, SEEK_SET)) {
+                error(err_output_write_error);
+        }
+        write_u32(d->f, d->count);
+        xfclose(d->f);
+}
+
+/*
+ * Columnar output: a file per column, in layouts which NumPy and Arrow map
+ * without copying or per-row objects:
+ *
+ *   PREFIX.time.i64    seconds since epoch, UTC (int64)
+ *   PREFIX.tz.i16      time zone offset of the line in minutes (int16)
+ *   PREFIX.status.i16  status code (int16)
+ *   PREFIX.bytes.i64   bytes sent, 0 for '-' (int64)
+ *   PREFIX.duration.i64  duration in microseconds (int64)
+ *   PREFIX.NAME.off64  other columns: row offsets into the data file, with
+ *   PREFIX.NAME.utf8   n + 1 entries starting with 0 (Arrow large_string)
+ *   PREFIX.schema.txt  number of rows, then name and suffix of each column
+ *   PREFIX.zones.bin   zone map of each block of COLUMNAR_BLOCK_ROWS rows:
+ *                      rows (u32), min and max time (int64 each), min and
+ *                      max status (int16 each), zeroes for absent columns
+ *
+ * With --encode, numeric columns are written to PREFIX.NAME.enc instead,
+ * block by block: size of the block data (u32), encoding (u8), then data
+ *
+ *   ENCODING_PLAIN     int64 values
+ *   ENCODING_FOR       minimum (int64), bit width (u8), bit-packed values
+ *                      minus the minimum
+ *   ENCODING_DELTA     first value and first delta (int64 each), bit width
+ *                      (u8), bit-packed deltas of deltas (zigzag)
+ *   ENCODING_RLE       runs of a value (zigzag) and its length (varints)
+ *
+ * The smallest encoding of each block is chosen.  Bits are packed starting
+ * from the least significant bit of the first byte.
+ *
+ * Numbers are little-endian.
+ */
+
+enum column_type {
+        TYPE_STRING,
+        TYPE_TIME,
+        TYPE_I16,
+        TYPE_I64
+};
+
+#define COLUMNAR_BLOCK_ROWS 65536
+#define ZONE_SIZE 24
+
+struct zone {
+        unsigned long rows;
+        long time_min;
+        long time_max;
+        int status_min;
+        int status_max;
+};
+
+struct columnar {
+        const char *prefix;
+        FILE *files[MAX_COLUMNS];
+        FILE *data[MAX_COLUMNS];
+        unsigned long offsets[MAX_COLUMNS];
+        FILE *tz;
+        FILE *zones;
+        struct zone zone;
+        unsigned long rows;
+        struct trigrams *trigrams;
+        long *values[MAX_COLUMNS];
+        long *tz_values;
+        struct dictionary *dictionary;
+};
+
+static enum column_type column_type(int column)
+{
+        switch (column) {
+        case FIELD_TIME:
+                return TYPE_TIME;
+        case FIELD_STATUS:
+                return TYPE_I16;
+        case FIELD_BYTES:
+        case FIELD_DURATION:
+        case COLUMN_LINE:
+                return TYPE_I64;
+        default:
+                return TYPE_STRING;
+        }
+}
+
+static const char *column_suffix(enum column_type type)
+{
+        switch (type) {
+        case TYPE_TIME:
+        case TYPE_I64:
+                return "i64";
+        case TYPE_I16:
+                return "i16";
+        case TYPE_STRING:
+                break;
+        }
+        return "off64";
+}
+
+enum encoding {
+        ENCODING_PLAIN,
+        ENCODING_FOR,
+        ENCODING_DELTA,
+        ENCODING_RLE
+};
+
+#define ENCODING_HEADER_SIZE 5
+
+struct bit_writer {
+        FILE *out;
+        unsigned acc;
+        int bits;
+};
+
+static void bits_put(struct bit_writer *w, unsigned long v, int width)
+{
+        while (width > 0) {
+                int n = 8 - w->bits < width ? 8 - w->bits : width;
+
+                w->acc |= (unsigned)(v & ((1UL << n) - 1)) << w->bits;
+                v >>= n;
+                w->bits += n;
+                width -= n;
+                if (w->bits == 8) {
+                        putc((int)w->acc, w->out);
+                        w->acc = 0;
+                        w->bits = 0;
+                }
+        }
+}
+
+static void bits_flush(struct bit_writer *w)
+{
+        if (w->bits) {
+                putc((int)w->acc, w->out);
+        }
+}
+
+static unsigned long zigzag(long v)
+{
+        return v < 0 ? ~((unsigned long)v << 1) : (unsigned long)v << 1;
+}
+
+static long unzigzag(unsigned long v)
+{
+        return v & 1 ? -(long)(v >> 1) - 1 : (long)(v >> 1);
+}
+
+static int bit_width(unsigned long v)
+{
+        int n = 0;
+
+        while (v) {
+                v >>= 1;
+                n++;
+        }
+        return n;
+}
+
+static unsigned long packed_size(unsigned long n, int width)
+{
+        return (n * (unsigned long)width + 7) / 8;
+}
+
+static long delta_of_delta(const long *v, unsigned long i)
+{
+        return (v[i] - v[i - 1]) - (v[i - 1] - v[i - 2]);
+}
+
+static void encode_block(FILE *out, const long *v, unsigned long n)
+{
+        unsigned long sizes[4], range, dod_max = 0, i, run;
+        long min = v[0], max = v[0];
+        int for_width, delta_width;
+        enum encoding best = ENCODING_PLAIN;
+        struct bit_writer w;
+
+        for (i = 1; i < n; i++) {
+                min = v[i] < min ? v[i] : min;
+                max = v[i] > max ? v[i] : max;
+        }
+        range = (unsigned long)max - (unsigned long)min;
+        for (i = 2; i < n; i++) {
+                unsigned long z = zigzag(delta_of_delta(v, i));
+
+                dod_max = z > dod_max ? z : dod_max;
+        }
+        for_width = bit_width(range);
+        delta_width = bit_width(dod_max);
+
+        sizes[ENCODING_PLAIN] = n * 8;
+        sizes[ENCODING_FOR] = 9 + packed_size(n, for_width);
+        sizes[ENCODING_DELTA] =
+            n < 2 ? sizes[ENCODING_PLAIN]
+                  : 17 + packed_size(n - 2, delta_width);
+        sizes[ENCODING_RLE] = 0;
+        for (i = 0; i < n; i += run) {
+                for (run = 1; i + run < n && v[i + run] == v[i]; run++)
+                        ;
+                sizes[ENCODING_RLE] += varint_size(zigzag(v[i]))
+                                       + varint_size(run);
+        }
+        if (sizes[ENCODING_FOR] < sizes[best]) {
+                best = ENCODING_FOR;
+        }
+        if (sizes[ENCODING_DELTA] < sizes[best]) {
+                best = ENCODING_DELTA;
+        }
+        if (sizes[ENCODING_RLE] < sizes[best]) {
+                best = ENCODING_RLE;
+        }
+
+        write_u32(out, sizes[best]);
+        putc((int)best, out);
+        w.out = out;
+        w.acc = 0;
+        w.bits = 0;
+        switch (best) {
+        case ENCODING_PLAIN:
+                for (i = 0; i < n; i++) {
+                        write_i64(out, v[i]);
+                }
+                break;
+        case ENCODING_FOR:
+                write_i64(out, min);
+                putc(for_width, out);
+                for (i = 0; i < n; i++) {
+                        bits_put(&w, (unsigned long)v[i] - (unsigned long)min,
+                                 for_width);
+                }
+                bits_flush(&w);
+                break;
+        case ENCODING_DELTA:
+                write_i64(out, v[0]);
+                write_i64(out, v[1] - v[0]);
+                putc(delta_width, out);
+                for (i = 2; i < n; i++) {
+                        bits_put(&w, zigzag(delta_of_delta(v, i)), delta_width);
+                }
+                bits_flush(&w);
+                break;
+        case ENCODING_RLE:
+                for (i = 0; i < n; i += run) {
+                        for (run = 1; i + run < n && v[i + run] == v[i]; run++)
+                                ;
+                        write_varint(out, zigzag(v[i]));
+                        write_varint(out, run);
+                }
+                break;
+        }
+}
+
+static FILE *columnar_open(const struct columnar *c,
+                           const char *name,
+                           const char *suffix)
+{
+        char *path = xmalloc(strlen(c->prefix) + strlen(name) + 16);
+        FILE *f;
+
+        sprintf(path, "%s.%s.%s", c->prefix, name, suffix);
+        f = xfopen(path, "wb");
+        free(path);
+        return f;
+}
+
+/* Digits of a field as a number, 0 if there are none like in '-' */
+static long span_to_long(const struct span *f)
+{
+        long v = 0;
+        size_t i;
+
+        for (i = 0; i < f->len && isdigit(f->ptr[i]); i++) {
+                v = v * 10 + (f->ptr[i] - '0');
+        }
+        return v;
+}
+
+/* Offset of the time zone like -0700 in minutes */
+/* C90 leaves rounding of negative division to the implementation */
+static int gmt_offset_minutes(int gmt_offset)
+{
+        int hhmm = gmt_offset < 0 ? -gmt_offset : gmt_offset;
+        int minutes = hhmm / 100 * 60 + hhmm % 100;
+
+        return gmt_offset < 0 ? -minutes : minutes;
+}
+
+static long record_epoch(const struct record *r)
+{
+        return tm_to_seconds(&r->time)
+               - gmt_offset_minutes(r->gmt_offset) * 60L;
+}
+
+static void columnar_open_all(struct columnar *c,
+                              const char *prefix,
+                              const struct options *o)
+{
+        size_t i, j;
+
+        /* A file per column, so a repeated column would be opened twice */
+        for (i = 0; i < o->columns_count; i++) {
+                for (j = 0; j < i; j++) {
+                        if (o->columns[j] == o->columns[i]) {
+                                error(err_wrong_option_value);
+                        }
+                }
+        }
+        memset(c, 0, sizeof(*c));
+        c->prefix = prefix;
+        c->zones = columnar_open(c, "zones", "bin");
+        if (o->dictionary_path) {
+                c->dictionary = xmalloc(sizeof(*c->dictionary));
+                dictionary_open(c->dictionary, o->dictionary_path, 1);
+        }
+        for (i = 0; i < o->columns_count; i++) {
+                const char *name = column_name(o->columns[i], o);
+                enum column_type type = column_type(o->columns[i]);
+
+                if (type != TYPE_STRING && o->encode) {
+                        c->files[i] = columnar_open(c, name, "enc");
+                        c->values[i] =
+                            xmalloc(COLUMNAR_BLOCK_ROWS * sizeof(long));
+                } else if (type == TYPE_STRING && c->dictionary) {
+                        c->files[i] = columnar_open(c, name, "id32");
+                } else {
+                        c->files[i] =
+                            columnar_open(c, name, column_suffix(type));
+                }
+                if (type == TYPE_STRING && !c->dictionary) {
+                        c->data[i] = columnar_open(c, name, "utf8");
+                        write_u64(c->files[i], 0);
+                } else if (type == TYPE_TIME && o->encode) {
+                        c->tz = columnar_open(c, "tz", "enc");
+                        c->tz_values =
+                            xmalloc(COLUMNAR_BLOCK_ROWS * sizeof(long));
+                } else if (type == TYPE_TIME) {
+                        c->tz = columnar_open(c, "tz", "i16");
+                }
+        }
+        if (o->trigrams) {
+                c->trigrams = xcalloc(1, sizeof(*c->trigrams));
+                c->trigrams->seen = xcalloc(TRIGRAM_COUNT / 8, 1);
+        }
+}
+
+static void columnar_write_zone(struct columnar *c)
+{
+        write_u32(c->zones, c->zone.rows);
+        write_i64(c->zones, c->zone.time_min);
+        write_i64(c->zones, c->zone.time_max);
+        write_u16(c->zones, (unsigned)c->zone.status_min & 0xFFFF);
+        write_u16(c->zones, (unsigned)c->zone.status_max & 0xFFFF);
+        memset(&c->zone, 0, sizeof(c->zone));
+}
+
+static void columnar_update_zone(struct columnar *c, int column, long v)
+{
+        int first = c->zone.rows == 0;
+
+        if (column == FIELD_TIME) {
+                if (first || v < c->zone.time_min) {
+                        c->zone.time_min = v;
+                }
+                if (first || v > c->zone.time_max) {
+                        c->zone.time_max = v;
+                }
+        } else if (column == FIELD_STATUS) {
+                if (first || v < c->zone.status_min) {
+                        c->zone.status_min = (int)v;
+                }
+                if (first || v > c->zone.status_max) {
+                        c->zone.status_max = (int)v;
+                }
+        }
+}
+
+/* Encodes the numeric columns of the block, which is about to end */
+static void columnar_encode_block(struct columnar *c)
+{
+        size_t i;
+
+        for (i = 0; i < MAX_COLUMNS; i++) {
+                if (c->values[i]) {
+                        encode_block(c->files[i], c->values[i], c->zone.rows);
+                }
+        }
+        if (c->tz_values) {
+                encode_block(c->tz, c->tz_values, c->zone.rows);
+        }
+}
+
+static void
+columnar_number(struct columnar *c, size_t i, enum column_type type, long v)
+{
+        if (c->values[i]) {
+                c->values[i][c->zone.rows] = v;
+        } else if (type == TYPE_I16) {
+                write_u16(c->files[i], (unsigned)v & 0xFFFF);
+        } else {
+                write_i64(c->files[i], v);
+        }
+}
+
+static void columnar_write(struct columnar *c,
+                           const struct record *r,
+                           const struct options *o)
+{
+        size_t i;
+
+        for (i = 0; i < o->columns_count; i++) {
+                int column = o->columns[i];
+                struct span f;
+
+                switch (column_type(column)) {
+                case TYPE_TIME:
+                        columnar_number(c, i, TYPE_I64, record_epoch(r));
+                        if (c->tz_values) {
+                                c->tz_values[c->zone.rows] =
+                                    gmt_offset_minutes(r->gmt_offset);
+                        } else {
+                                write_u16(c->tz,
+                                          (unsigned)gmt_offset_minutes(
+                                              r->gmt_offset)
+                                              & 0xFFFF);
+                        }
+                        columnar_update_zone(c, column, record_epoch(r));
+                        break;
+                case TYPE_I16:
+                        f = record_field(r, column);
+                        columnar_number(c, i, TYPE_I16, span_to_long(&f));
+                        columnar_update_zone(c, column, span_to_long(&f));
+                        break;
+                case TYPE_I64:
+                        if (column == FIELD_DURATION) {
+                                columnar_number(c,
+                                                i,
+                                                TYPE_I64,
+                                                (long)r->duration_us);
+                        } else if (column == COLUMN_LINE) {
+                                columnar_number(c, i, TYPE_I64, (long)r->line);
+                        } else {
+                                f = record_field(r, column);
+                                columnar_number(c,
+                                                i,
+                                                TYPE_I64,
+                                                span_to_long(&f));
+                        }
+                        break;
+                case TYPE_STRING:
+                        if (column >= COLUMN_LOOKUP) {
+                                f = r->lookups[column - COLUMN_LOOKUP];
+                        } else if (column == COLUMN_ERRORS) {
+                                f = r->errors;
+                        } else {
+                                f = record_field(r, column);
+                        }
+                        if (c->dictionary) {
+                                write_u32(c->files[i],
+                                          dictionary_id(c->dictionary, f));
+                                break;
+                        }
+                        fwrite(f.ptr, 1, f.len, c->data[i]);
+                        c->offsets[i] += f.len;
+                        write_u64(c->files[i], c->offsets[i]);
+                        break;
+                }
+        }
+        if (c->trigrams) {
+                trigrams_add(c->trigrams, request_path(r));
+        }
+        c->rows++;
+        if (++c->zone.rows == COLUMNAR_BLOCK_ROWS) {
+                columnar_encode_block(c);
+                columnar_write_zone(c);
+                if (c->trigrams) {
+                        trigrams_end_block(c->trigrams);
+                }
+        }
+}
+
+static void columnar_close(struct columnar *c, const struct options *o)
+{
+        FILE *schema = columnar_open(c, "schema", "txt");
+        size_t i;
+
+        if (c->zone.rows) {
+                columnar_encode_block(c);
+                columnar_write_zone(c);
+                if (c->trigrams) {
+                        trigrams_end_block(c->trigrams);
+                }
+        }
+        xfclose(c->zones);
+        if (c->trigrams) {
+                FILE *out = columnar_open(c, "trigrams", "bin");
+
+                trigrams_write(c->trigrams, out);
+                xfclose(out);
+        }
+        fprintf(schema, "rows\t%lu\n", c->rows);
+        for (i = 0; i < o->columns_count; i++) {
+                const char *name = column_name(o->columns[i], o);
+                enum column_type type = column_type(o->columns[i]);
+
+                if (c->values[i]) {
+                        fprintf(schema, "%s\tenc\n", name);
+                } else if (type == TYPE_STRING && c->dictionary) {
+                        fprintf(schema, "%s\tid32\n", name);
+                } else {
+                        fprintf(schema, "%s\t%s\n", name, column_suffix(type));
+                }
+                if (type == TYPE_TIME) {
+                        fprintf(schema,
+                                "tz\t%s\n",
+                                c->tz_values ? "enc" : "i16");
+                }
+                xfclose(c->files[i]);
+                if (c->data[i]) {
+                        xfclose(c->data[i]);
+                }
+        }
+        if (c->tz) {
+                xfclose(c->tz);
+        }
+        if (c->dictionary) {
+                dictionary_close(c->dictionary);
+        }
+        xfclose(schema);
+}
+
+/*
+ * Clustered output: rows of a window are reordered by a cluster key, so rows
+ * of the same client or path are adjacent and compress better.  The line
+ * column keeps the original order, which sort -n restores.
+ */
+
+#define DEFAULT_CLUSTER_WINDOW 65536
+
+struct cluster_row {
+        size_t row; /* offset in output */
+        size_t len;
+        size_t key; /* offset in keys */
+        size_t key_len;
+};
+
+static struct cluster {
+        struct cluster_row *rows;
+        size_t len;
+        char *keys;
+        size_t keys_len;
+        size_t keys_cap;
+        char *sorted;
+        size_t sorted_cap;
+} cluster;
+
+static void cluster_key_bytes(const char *p, size_t n)
+{
+        if (cluster.keys_len + n > cluster.keys_cap) {
+                char *keys;
+
+                cluster.keys_cap = (cluster.keys_len + n) * 2;
+                keys = xmalloc(cluster.keys_cap);
+                memcpy(keys,
+                       cluster.keys ? cluster.keys : "",
+                       cluster.keys_len);
+                free(cluster.keys);
+                cluster.keys = keys;
+        }
+        memcpy(cluster.keys + cluster.keys_len, p, n);
+        cluster.keys_len += n;
+}
+
+/* Keys compare bytewise, times as big-endian numbers with the sign flipped */
+static void cluster_key(const struct record *r, int field)
+{
+        unsigned char time_buf[sizeof(long)];
+        unsigned long t;
+        struct span f;
+        size_t i;
+
+        if (field == FIELD_TIME) {
+                t = (unsigned long)record_epoch(r)
+                    ^ 1UL << (sizeof(long) * 8 - 1);
+                for (i = sizeof(long); i > 0; i--) {
+                        time_buf[i - 1] = (unsigned char)(t & 0xFF);
+                        t >>= 8;
+                }
+                cluster_key_bytes((const char *)time_buf, sizeof(time_buf));
+        } else {
+                f = record_field(r, field);
+                cluster_key_bytes(f.ptr, f.len);
+                cluster_key_bytes("", 1);
+        }
+}
+
+static int compare_cluster_rows(const void *a, const void *b)
+{
+        const struct cluster_row *x = a;
+        const struct cluster_row *y = b;
+        size_t n = x->key_len < y->key_len ? x->key_len : y->key_len;
+        int c = memcmp(cluster.keys + x->key, cluster.keys + y->key, n);
+
+        if (c) {
+                return c;
+        }
+        if (x->key_len != y->key_len) {
+                return x->key_len < y->key_len ? -1 : 1;
+        }
+        return x->row < y->row ? -1 : x->row > y->row;
+}
+
+/* Writes rows of the window ordered by their keys */
+static void cluster_flush(void)
+{
+        char *sorted;
+        size_t i, len = 0, cap;
+
+        qsort(cluster.rows,
+              cluster.len,
+              sizeof(*cluster.rows),
+              compare_cluster_rows);
+        if (cluster.sorted_cap < output.len) {
+                free(cluster.sorted);
+                cluster.sorted_cap = output.cap;
+                cluster.sorted = xmalloc(cluster.sorted_cap);
+        }
+        sorted = cluster.sorted;
+        for (i = 0; i < cluster.len; i++) {
+                const struct cluster_row *row = &cluster.rows[i];
+
+                memcpy(sorted + len, output.data + row->row, row->len);
+                len += row->len;
+        }
+        cap = cluster.sorted_cap;
+        cluster.sorted = output.data;
+        cluster.sorted_cap = output.cap;
+        output.data = sorted;
+        output.cap = cap;
+        out_flush();
+        cluster.len = 0;
+        cluster.keys_len = 0;
+}
+
+static void cluster_add(const struct record *r, const struct options *o)
+{
+        struct cluster_row *row;
+        size_t i;
+
+        if (!cluster.rows) {
+                cluster.rows = xmalloc(o->cluster_window * sizeof(*row));
+        }
+        if (!cluster.len) {
+                out_flush();
+        }
+        row = &cluster.rows[cluster.len++];
+        row->row = output.len;
+        row->key = cluster.keys_len;
+        for (i = 0; i < o->cluster_count; i++) {
+                cluster_key(r, o->cluster_fields[i]);
+        }
+        row->key_len = cluster.keys_len - row->key;
+        print_record(r, o);
+        row->len = output.len - row->row;
+        if (cluster.len == o->cluster_window) {
+                cluster_flush();
+        }
+}
+
+/*
+ * Bloom filter sidecars answer whether a host or path may appear in a file
+ * without reading it.  Filters are blocked: all bits of a key are in a single
+ * cache line sized block, so a check reads 64 bytes of the sidecar.
+ *
+ *   "ALTB", version, number of blocks, bits per key (u32 each)
+ *   blocks of BLOOM_BLOCK_SIZE bytes
+ *
+ * Distinct keys are collected during conversion, so the filter is sized for
+ * the wanted false-positive rate once their number is known.
+ */
+
+#define BLOOM_VERSION 2
+#define BLOOM_HEADER_SIZE 16
+#define BLOOM_BLOCK_SIZE 64
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_SIZE * 8)
+
+static unsigned long mix32(unsigned long h)
+{
+        h ^= h >> 16;
+        h = (h * 0x85EBCA6BUL) & 0xFFFFFFFFUL;
+        h ^= h >> 13;
+        h = (h * 0xC2B2AE35UL) & 0xFFFFFFFFUL;
+        h ^= h >> 16;
+        return h;
+}
+
+/* Bit positions of the key hash h1 + i * h2 within the block */
+static void bloom_hashes(const char *key,
+                         unsigned long blocks,
+                         unsigned long *block,
+                         unsigned long *h1,
+                         unsigned long *h2)
+{
+        unsigned long h = hash_bytes(key, strlen(key));
+
+        *block = mix32(h) % blocks;
+        *h1 = mix32(h ^ 0x9E3779B9UL);
+        *h2 = mix32(h ^ 0x7F4A7C15UL) | 1;
+}
+
+/*
+ * Hashed rather than h1 + i * h2 modulo the block, whose 2^17 patterns
+ * repeat often enough among the keys of a block to double the rate.
+ */
+static unsigned long bloom_bit(unsigned long h1,
+                               unsigned long h2,
+                               unsigned long i)
+{
+        return mix32((h1 + i * h2) & 0xFFFFFFFFUL) % BLOOM_BLOCK_BITS;
+}
+
+/* Number of bits set per key, which gives the false-positive rate wanted */
+static unsigned long bloom_bits_per_key(double fpr)
+{
+        unsigned long k = 1;
+        double p = 0.5;
+
+        while (p > fpr && k < 16) {
+                p /= 2;
+                k++;
+        }
+        return k;
+}
+
+/* x to a whole power by squaring, as C90 has no exp() without libm */
+static double pow_whole(double x, unsigned long n)
+{
+        double r = 1;
+
+        for (; n; n >>= 1, x *= x) {
+                if (n & 1) {
+                        r *= x;
+                }
+        }
+        return r;
+}
+
+/*
+ * False-positive rate of a blocked filter: keys fall into blocks unevenly,
+ * and crowded blocks answer yes more often than the bits per key suggest,
+ * so the rate is averaged over the binomial number of keys in a block.
+ */
+static double bloom_blocked_fpr(unsigned long keys,
+                                unsigned long blocks,
+                                unsigned long k)
+{
+        double q = 1.0 / (double)blocks;
+        double clear = 1 - (double)k / BLOOM_BLOCK_BITS;
+        double p, seen = 0, fpr = 0;
+        unsigned long c;
+
+        if (blocks == 1) {
+                return pow_whole(1 - pow_whole(clear, keys), k);
+        }
+        p = pow_whole(1 - q, keys);
+        for (c = 0; c <= keys && seen < 1 - 1e-9; c++) {
+                if (c) {
+                        p *= (double)(keys - c + 1) / (double)c * q / (1 - q);
+                }
+                fpr += p * pow_whole(1 - pow_whole(clear, c), k);
+                seen += p;
+        }
+        return fpr;
+}
+
+static void bloom_add_key(struct map *keys, const char *name, struct span v)
+{
+        char key_buf[4096 + 16];
+        size_t name_len = strlen(name);
+
+        if (v.len + name_len + 2 > sizeof(key_buf)) {
+                return;
+        }
+        memcpy(key_buf, name, name_len);
+        key_buf[name_len] = '=';
+        memcpy(key_buf + name_len + 1, v.ptr, v.len);
+        key_buf[name_len + 1 + v.len] = '\0';
+        if (!map_get(keys, key_buf)) {
+                char *key = xstrdup(key_buf);
+
+                map_put(keys, key, key);
+        }
+}
+
+static void bloom_write(const struct map *keys,
+                        const char *path,
+                        double fpr,
+                        unsigned long size)
+{
+        unsigned long k = bloom_bits_per_key(fpr);
+        unsigned long blocks, i, b, h1, h2;
+        unsigned char *bits;
+        FILE *out;
+
+        /* 1.44 bits per set bit is optimal, blocking takes some more */
+        if (size) {
+                blocks = (size + BLOOM_BLOCK_SIZE - 1) / BLOOM_BLOCK_SIZE;
+        } else {
+                blocks = (keys->len * k * 3 / 2 + BLOOM_BLOCK_BITS - 1)
+                         / BLOOM_BLOCK_BITS;
+        }
+        if (!blocks) {
+                blocks = 1;
+        }
+        while (!size && keys->len
+               && bloom_blocked_fpr(keys->len, blocks, k) > fpr) {
+                blocks += blocks / 32 + 1;
+        }
+        bits = xcalloc(blocks, BLOOM_BLOCK_SIZE);
+        for (i = 0; i < keys->cap; i++) {
+                unsigned long j;
+
+                if (!keys->slots[i].key) {
+                        continue;
+                }
+                bloom_hashes(keys->slots[i].key, blocks, &b, &h1, &h2);
+                for (j = 0; j < k; j++) {
+                        unsigned long bit = bloom_bit(h1, h2, j);
+
+                        bits[b * BLOOM_BLOCK_SIZE + bit / 8] |=
+                            (unsigned char)(1 << (bit % 8));
+                }
+        }
+
+        out = xfopen(path, "wb");
+        fwrite("ALTB", 1, 4, out);
+        write_u32(out, BLOOM_VERSION);
+        write_u32(out, blocks);
+        write_u32(out, k);
+        fwrite(bits, BLOOM_BLOCK_SIZE, blocks, out);
+        xfclose(out);
+        free(bits);
+}
+
+static int bloom_may_contain(const char *path, const char *key)
+{
+        FILE *in = xfopen(path, "rb");
+        unsigned char head[BLOOM_HEADER_SIZE];
+        unsigned char block[BLOOM_BLOCK_SIZE];
+        unsigned long blocks, k, b, h1, h2, j;
+
+        if (fread(head, 1, sizeof(head), in) != sizeof(head)
+            || memcmp(head, "ALTB", 4) || read_u32(head + 4) != BLOOM_VERSION
+            || !(blocks = read_u32(head + 8))) {
+                error(err_wrong_bloom_file);
+        }
+        k = read_u32(head + 12);
+        bloom_hashes(key, blocks, &b, &h1, &h2);
+        if (fseek(in,
+                  (long)(BLOOM_HEADER_SIZE + b * BLOOM_BLOCK_SIZE),
+                  SEEK_SET)
+            || fread(block, 1, sizeof(block), in) != sizeof(block)) {
+                error(err_wrong_bloom_file);
+        }
+        fclose(in);
+        for (j = 0; j < k; j++) {
+                unsigned long bit = bloom_bit(h1, h2, j);
+
+                if (!(block[bit / 8] & (1 << (bit % 8)))) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/* bloom-check NAME=VALUE SIDECAR...: prints sidecars which may have it */
+static void bloom_check_command(int argc, char *argv[])
+{
+        const char *value = argc < 3 ? NULL : strchr(argv[2], '=');
+        int i;
+
+        if (argc < 3) {
+                error(err_missing_option_value);
+        }
+        /* Only hosts and paths are added, see bloom_add_key() calls */
+        if (!value || value - argv[2] != 4
+            || (strncmp(argv[2], "host", 4) && strncmp(argv[2], "path", 4))) {
+                error(err_wrong_option_value);
+        }
+        for (i = 3; i < argc; i++) {
+                if (bloom_may_contain(argv[i], argv[2])) {
+                        printf("%s\n", argv[i]);
+                }
+        }
+}
+
+/*
+ * Query over columnar output: blocks are skipped by their zone maps, and
+ * only columns used by the query are read for the remaining ones.
+ */
+
+struct query_column {
+        char name[64];
+        enum column_type type;
+        FILE *f;
+        FILE *data;
+        unsigned char *buf;
+        size_t buf_cap;
+        char *str;
+        size_t str_cap;
+        unsigned long first; /* first row of the loaded block */
+        int used;
+        int encoded;
+        long *values; /* decoded block of an encoded column */
+        size_t values_cap;
+        unsigned long next; /* first row of the next block in the file */
+        const struct dictionary *dictionary; /* of id32 columns */
+        int ids;
+};
+
+struct query_filter {
+        struct query_column *column;
+        const char *value;
+        long number; /* or ID of the value in id32 columns, -1 if absent */
+};
+
+struct query {
+        const char *prefix;
+        struct query_column columns[MAX_COLUMNS];
+        size_t columns_count;
+        unsigned long rows;
+        int has_from;
+        int has_to;
+        long from;
+        long to;
+        int has_status;
+        int status_min;
+        int status_max;
+        struct query_filter filters[MAX_FILTERS];
+        size_t filters_count;
+        struct query_column *group_by;
+        struct query_column *time;
+        struct query_column *status;
+        struct query_column *bytes;
+        int stats;
+        struct dictionary *dictionary;
+};
+
+struct query_group {
+        unsigned long count;
+        unsigned long bytes;
+};
+
+static size_t type_width(enum column_type type)
+{
+        return type == TYPE_I16 ? 2 : 8;
+}
+
+static void *grow(void *p, size_t *cap, size_t size)
+{
+        if (size > *cap) {
+                free(p);
+                *cap = size * 2;
+                p = xmalloc(*cap);
+        }
+        return p;
+}
+
+static struct query_column *query_column(struct query *q, const char *name)
+{
+        size_t i;
+
+        for (i = 0; i < q->columns_count; i++) {
+                if (!strcmp(q->columns[i].name, name)) {
+                        q->columns[i].used = 1;
+                        return &q->columns[i];
+                }
+        }
+        error(err_unknown_column);
+        return NULL;
+}
+
+static FILE *
+query_open(const struct query *q, const char *name, const char *sfx)
+{
+        char *path = xmalloc(strlen(q->prefix) + strlen(name) + 16);
+        FILE *f;
+
+        sprintf(path, "%s.%s.%s", q->prefix, name, sfx);
+        f = xfopen(path, "rb");
+        free(path);
+        return f;
+}
+
+static void query_read_schema(struct query *q)
+{
+        FILE *schema = query_open(q, "schema", "txt");
+        char line_buf[256];
+        char suffix[16];
+
+        if (!fgets(line_buf, sizeof(line_buf), schema)
+            || sscanf(line_buf, "rows\t%lu", &q->rows) != 1) {
+                error(err_wrong_columnar_files);
+        }
+        while (fgets(line_buf, sizeof(line_buf), schema)) {
+                struct query_column *c = &q->columns[q->columns_count];
+
+                if (q->columns_count == MAX_COLUMNS
+                    || sscanf(line_buf, "%63s %15s", c->name, suffix) != 2) {
+                        error(err_wrong_columnar_files);
+                }
+                if (!strcmp(suffix, "off64")) {
+                        c->type = TYPE_STRING;
+                } else if (!strcmp(suffix, "i16")) {
+                        c->type = TYPE_I16;
+                } else if (!strcmp(suffix, "i64")) {
+                        c->type = TYPE_I64;
+                } else if (!strcmp(suffix, "enc")) {
+                        c->type = TYPE_I64;
+                        c->encoded = 1;
+                } else if (!strcmp(suffix, "id32")) {
+                        c->type = TYPE_STRING;
+                        c->ids = 1;
+                } else {
+                        error(err_wrong_columnar_files);
+                }
+                q->columns_count++;
+        }
+        fclose(schema);
+}
+
+static unsigned long
+bits_get(const unsigned char *p, unsigned long *pos, int width)
+{
+        unsigned long v = 0;
+        int done = 0;
+
+        while (done < width) {
+                int bit = (int)(*pos % 8);
+                int n = 8 - bit < width - done ? 8 - bit : width - done;
+
+                v |= (unsigned long)((p[*pos / 8] >> bit) & ((1U << n) - 1))
+                     << done;
+                done += n;
+                *pos += (unsigned long)n;
+        }
+        return v;
+}
+
+static unsigned long
+read_varint(const unsigned char **p, const unsigned char *end)
+{
+        unsigned long v = 0;
+        int shift = 0;
+
+        do {
+                if (*p == end || shift > 63) {
+                        error(err_wrong_columnar_files);
+                }
+                v |= (unsigned long)(**p & 0x7F) << shift;
+                shift += 7;
+        } while (*(*p)++ & 0x80);
+        return v;
+}
+
+static void decode_block(const unsigned char *p,
+                         unsigned long size,
+                         int encoding,
+                         long *v,
+                         unsigned long n)
+{
+        const unsigned char *end = p + size;
+        unsigned long i, pos = 0;
+        int width;
+        long min;
+
+        switch (encoding) {
+        case ENCODING_PLAIN:
+                if (size < n * 8) {
+                        error(err_wrong_columnar_files);
+                }
+                for (i = 0; i < n; i++) {
+                        v[i] = read_i64(p + i * 8);
+                }
+                break;
+        case ENCODING_FOR:
+                if (size < 9 || size < 9 + packed_size(n, p[8])) {
+                        error(err_wrong_columnar_files);
+                }
+                min = read_i64(p);
+                width = p[8];
+                for (i = 0; i < n; i++) {
+                        v[i] = (long)((unsigned long)min
+                                      + bits_get(p + 9, &pos, width));
+                }
+                break;
+        case ENCODING_DELTA:
+                if (n < 2 || size < 17
+                    || size < 17 + packed_size(n - 2, p[16])) {
+                        error(err_wrong_columnar_files);
+                }
+                v[0] = read_i64(p);
+                v[1] = v[0] + read_i64(p + 8);
+                width = p[16];
+                for (i = 2; i < n; i++) {
+                        v[i] = 2 * v[i - 1] - v[i - 2]
+                               + unzigzag(bits_get(p + 17, &pos, width));
+                }
+                break;
+        case ENCODING_RLE:
+                for (i = 0; i < n;) {
+                        long value = unzigzag(read_varint(&p, end));
+                        unsigned long run = read_varint(&p, end);
+
+                        if (run > n - i) {
+                                error(err_wrong_columnar_files);
+                        }
+                        while (run--) {
+                                v[i++] = value;
+                        }
+                }
+                break;
+        default:
+                error(err_wrong_columnar_files);
+        }
+}
+
+/* Encoded blocks vary in size, so they are found by skipping from start */
+static void query_load_encoded(struct query *q,
+                               struct query_column *c,
+                               unsigned long first,
+                               unsigned long rows)
+{
+        unsigned char head[ENCODING_HEADER_SIZE];
+        unsigned long size;
+
+        if (!c->f) {
+                c->f = query_open(q, c->name, "enc");
+        }
+        if (first < c->next) {
+                rewind(c->f);
+                c->next = 0;
+        }
+        for (;;) {
+                if (fread(head, 1, sizeof(head), c->f) != sizeof(head)) {
+                        error(err_wrong_columnar_files);
+                }
+                size = read_u32(head);
+                if (c->next >= first) {
+                        break;
+                }
+                if (fseek(c->f, (long)size, SEEK_CUR)) {
+                        error(err_wrong_columnar_files);
+                }
+                c->next += COLUMNAR_BLOCK_ROWS;
+        }
+        c->buf = grow(c->buf, &c->buf_cap, size + 1);
+        c->values = grow(c->values, &c->values_cap, rows * sizeof(long));
+        if (fread(c->buf, 1, size, c->f) != size) {
+                error(err_wrong_columnar_files);
+        }
+        decode_block(c->buf, size, head[4], c->values, rows);
+        c->next += COLUMNAR_BLOCK_ROWS;
+        c->first = first;
+}
+
+/*
+ * Strings of id32 columns used by the query come from the dictionary, and
+ * filters on them compare IDs, looked up once here.
+ */
+static void query_bind_dictionary(struct query *q)
+{
+        size_t i;
+
+        for (i = 0; i < q->columns_count; i++) {
+                struct query_column *c = &q->columns[i];
+
+                if (c->ids && c->used && !q->dictionary) {
+                        error(err_missing_option_value);
+                }
+                c->dictionary = q->dictionary;
+        }
+        for (i = 0; i < q->filters_count; i++) {
+                struct query_filter *f = &q->filters[i];
+                unsigned long id;
+
+                if (f->column->ids) {
+                        id = dictionary_find(q->dictionary, f->value);
+                        f->number = id < q->dictionary->count ? (long)id : -1;
+                }
+        }
+}
+
+static void query_open_dictionary(struct query *q, const char *path)
+{
+        q->dictionary = xmalloc(sizeof(*q->dictionary));
+        dictionary_open(q->dictionary, path, 0);
+}
+
+static void query_load(struct query *q,
+                       struct query_column *c,
+                       unsigned long first,
+                       unsigned long rows)
+{
+        size_t width = c->type == TYPE_STRING ? 8 : type_width(c->type);
+        size_t n = c->type == TYPE_STRING ? rows + 1 : rows;
+
+        if (c->encoded) {
+                query_load_encoded(q, c, first, rows);
+                return;
+        }
+        if (c->ids) {
+                width = 4;
+                n = rows;
+        }
+        if (!c->f) {
+                c->f = query_open(q,
+                                  c->name,
+                                  c->ids ? "id32" : column_suffix(c->type));
+                if (c->type == TYPE_STRING && !c->ids) {
+                        c->data = query_open(q, c->name, "utf8");
+                }
+        }
+        c->buf = grow(c->buf, &c->buf_cap, n * width);
+        if (fseek(c->f, (long)(first * width), SEEK_SET)
+            || fread(c->buf, width, n, c->f) != n) {
+                error(err_wrong_columnar_files);
+        }
+        if (c->type == TYPE_STRING && !c->ids) {
+                long start = read_i64(c->buf);
+                size_t len = (size_t)(read_i64(c->buf + rows * 8) - start);
+
+                c->str = grow(c->str, &c->str_cap, len + 1);
+                if (fseek(c->data, start, SEEK_SET)
+                    || fread(c->str, 1, len, c->data) != len) {
+                        error(err_wrong_columnar_files);
+                }
+        }
+        c->first = first;
+}
+
+static long query_number(const struct query_column *c, unsigned long row)
+{
+        const unsigned char *p = c->buf + row * type_width(c->type);
+
+        if (c->encoded) {
+                return c->values[row];
+        }
+        return c->type == TYPE_I16 ? read_i16(p) : read_i64(p);
+}
+
+static struct span query_string(const struct query_column *c, unsigned long row)
+{
+        long base, start;
+        struct span s;
+
+        if (c->ids) {
+                return dictionary_string(c->dictionary,
+                                         read_u32(c->buf + row * 4));
+        }
+        base = read_i64(c->buf);
+        start = read_i64(c->buf + row * 8);
+        s.ptr = c->str + (start - base);
+        s.len = (size_t)(read_i64(c->buf + row * 8 + 8) - start);
+        return s;
+}
+
+static int query_row_matches(const struct query *q, unsigned long row)
+{
+        size_t i;
+
+        if (q->time) {
+                long t = query_number(q->time, row);
+
+                if ((q->has_from && t < q->from) || (q->has_to && t >= q->to)) {
+                        return 0;
+                }
+        }
+        if (q->has_status) {
+                long status = query_number(q->status, row);
+
+                if (status < q->status_min || status > q->status_max) {
+                        return 0;
+                }
+        }
+        for (i = 0; i < q->filters_count; i++) {
+                const struct query_filter *f = &q->filters[i];
+
+                if (f->column->ids) {
+                        if ((long)read_u32(f->column->buf + row * 4)
+                            != f->number) {
+                                return 0;
+                        }
+                } else if (f->column->type == TYPE_STRING) {
+                        struct span v = query_string(f->column, row);
+
+                        if (v.len != strlen(f->value)
+                            || memcmp(v.ptr, f->value, v.len)) {
+                                return 0;
+                        }
+                } else if (query_number(f->column, row) != f->number) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+static int zone_may_match(const struct query *q, const unsigned char *zone)
+{
+        if (q->has_from && read_i64(zone + 12) < q->from) {
+                return 0;
+        }
+        if (q->has_to && read_i64(zone + 4) >= q->to) {
+                return 0;
+        }
+        if (q->has_status && (read_i16(zone + 22) < q->status_min
+                              || read_i16(zone + 20) > q->status_max)) {
+                return 0;
+        }
+        return 1;
+}
+
+static void query_add(struct query *q,
+                      struct map *groups,
+                      unsigned long row,
+                      char *key_buf,
+                      size_t key_size)
+{
+        struct query_group *g;
+
+        if (!q->group_by) {
+                key_buf[0] = '\0';
+        } else if (q->group_by->type == TYPE_STRING) {
+                struct span v = query_string(q->group_by, row);
+                size_t len = v.len < key_size - 1 ? v.len : key_size - 1;
+
+                memcpy(key_buf, v.ptr, len);
+                key_buf[len] = '\0';
+        } else {
+                sprintf(key_buf, "%ld", query_number(q->group_by, row));
+        }
+        g = map_get(groups, key_buf);
+        if (!g) {
+                g = xcalloc(1, sizeof(*g));
+                map_put(groups, xstrdup(key_buf), g);
+        }
+        g->count++;
+        if (q->bytes) {
+                g->bytes += (unsigned long)query_number(q->bytes, row);
+        }
+}
+
+static void query_run(struct query *q)
+{
+        FILE *zones = query_open(q, "zones", "bin");
+        unsigned char zone[ZONE_SIZE];
+        struct map groups = {NULL, 0, 0};
+        struct map_entry *entries;
+        unsigned long first = 0, blocks = 0, scanned = 0, row;
+        char key_buf[4096];
+        size_t i;
+
+        while (fread(zone, 1, sizeof(zone), zones) == sizeof(zone)) {
+                unsigned long rows = read_u32(zone);
+
+                blocks++;
+                if (zone_may_match(q, zone)) {
+                        scanned++;
+                        for (i = 0; i < q->columns_count; i++) {
+                                struct query_column *c = &q->columns[i];
+
+                                if (c->used) {
+                                        query_load(q, c, first, rows);
+                                }
+                        }
+                        for (row = 0; row < rows; row++) {
+                                if (query_row_matches(q, row)) {
+                                        query_add(q,
+                                                  &groups,
+                                                  row,
+                                                  key_buf,
+                                                  sizeof(key_buf));
+                                }
+                        }
+                }
+                first += rows;
+        }
+        if (first != q->rows) {
+                error(err_wrong_columnar_files);
+        }
+        fclose(zones);
+
+        entries = map_sorted(&groups);
+        if (q->group_by) {
+                printf("%s\t", q->group_by->name);
+        }
+        printf(q->bytes ? "count\tbytes\n" : "count\n");
+        for (i = 0; i < groups.len; i++) {
+                const struct query_group *g = entries[i].value;
+
+                if (q->group_by) {
+                        printf("%s\t", entries[i].key);
+                }
+                printf("%lu", g->count);
+                if (q->bytes) {
+                        printf("\t%lu", g->bytes);
+                }
+                putchar('\n');
+        }
+        free(entries);
+        if (q->stats) {
+                fprintf(stderr, "blocks\t%lu\n", blocks);
+                fprintf(stderr, "blocks_scanned\t%lu\n", scanned);
+        }
+}
+
+/* query PREFIX [options] */
+static void query_command(int argc, char *argv[])
+{
+        struct query q;
+        int i;
+
+        memset(&q, 0, sizeof(q));
+        if (argc < 3) {
+                error(err_missing_option_value);
+        }
+        q.prefix = argv[2];
+        query_read_schema(&q);
+        for (i = 3; i < argc; i++) {
+                const char *arg = argv[i];
+                const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+                if (!strcmp(arg, "--stats")) {
+                        q.stats = 1;
+                        continue;
+                }
+                if (!value) {
+                        error(err_missing_option_value);
+                }
+                if (!strcmp(arg, "--from")) {
+                        q.from = parse_iso_datetime(value);
+                        q.has_from = 1;
+                        q.time = query_column(&q, "time");
+                } else if (!strcmp(arg, "--to")) {
+                        q.to = parse_iso_datetime(value);
+                        q.has_to = 1;
+                        q.time = query_column(&q, "time");
+                } else if (!strcmp(arg, "--status")) {
+                        if (sscanf(value, "%d:%d", &q.status_min, &q.status_max)
+                            != 2) {
+                                error(err_wrong_option_value);
+                        }
+                        q.has_status = 1;
+                        q.status = query_column(&q, "status");
+                } else if (!strcmp(arg, "--where")) {
+                        struct query_filter *f = &q.filters[q.filters_count];
+                        char *name = xstrdup(value);
+                        char *eq = strchr(name, '=');
+
+                        if (q.filters_count == MAX_FILTERS) {
+                                error(err_too_many_filters);
+                        }
+                        if (!eq) {
+                                error(err_wrong_option_value);
+                        }
+                        *eq = '\0';
+                        f->column = query_column(&q, name);
+                        f->value = eq + 1;
+                        f->number = strtol(f->value, NULL, 10);
+                        q.filters_count++;
+                } else if (!strcmp(arg, "--group-by")) {
+                        q.group_by = query_column(&q, value);
+                } else if (!strcmp(arg, "--dictionary")) {
+                        query_open_dictionary(&q, value);
+                } else {
+                        error(err_unknown_option);
+                }
+                i++;
+        }
+        for (i = 0; i < (int)q.columns_count; i++) {
+                if (!strcmp(q.columns[i].name, "bytes")) {
+                        q.bytes = query_column(&q, "bytes");
+                }
+        }
+        query_bind_dictionary(&q);
+        query_run(&q);
+}
+
+/* Reads a u32 at the offset of the trigram index */
+static unsigned long trigram_read_u32(FILE *in, long offset)
+{
+        unsigned char buf[4];
+
+        if (fseek(in, offset, SEEK_SET) || fread(buf, 1, 4, in) != 4) {
+                error(err_wrong_trigram_file);
+        }
+        return read_u32(buf);
+}
+
+static long trigram_entry(unsigned long i)
+{
+        return TRIGRAM_HEADER_SIZE + (long)i * TRIGRAM_ENTRY_SIZE;
+}
+
+/* Clears blocks of candidates which have no posting of the trigram */
+static void trigram_intersect(FILE *in,
+                              unsigned long count,
+                              unsigned long trigram,
+                              unsigned char *candidates,
+                              unsigned char *found,
+                              unsigned long blocks)
+{
+        long postings = trigram_entry(count);
+        unsigned long lo = 0, hi = count, block = 0, n, i;
+
+        while (lo < hi) {
+                unsigned long mid = lo + (hi - lo) / 2;
+
+                if (trigram_read_u32(in, trigram_entry(mid)) < trigram) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        memset(found, 0, blocks);
+        if (lo < count) {
+                long entry = trigram_entry(lo);
+
+                if (trigram_read_u32(in, entry) == trigram) {
+                        long offset = (long)trigram_read_u32(in, entry + 4);
+
+                        n = trigram_read_u32(in, entry + 8);
+                        if (fseek(in, postings + offset, SEEK_SET)) {
+                                error(err_wrong_trigram_file);
+                        }
+                        for (i = 0; i < n; i++) {
+                                unsigned long d = 0;
+                                int shift = 0, c;
+
+                                do {
+                                        c = getc(in);
+                                        if (c == EOF || shift > 28) {
+                                                error(err_wrong_trigram_file);
+                                        }
+                                        d |= (unsigned long)(c & 0x7F) << shift;
+                                        shift += 7;
+                                } while (c & 0x80);
+                                block += d;
+                                if (block >= blocks) {
+                                        error(err_wrong_trigram_file);
+                                }
+                                found[block] = 1;
+                        }
+                }
+        }
+        for (i = 0; i < blocks; i++) {
+                candidates[i] &= found[i];
+        }
+}
+
+static int span_contains(struct span s, const char *needle, size_t len)
+{
+        const char *end = s.ptr + s.len;
+        const char *p = s.ptr;
+
+        if (!len) {
+                return 1;
+        }
+        while (len <= (size_t)(end - p)
+               && (p = memchr(p, needle[0], (size_t)(end - p) - len + 1))) {
+                if (!memcmp(p, needle, len)) {
+                        return 1;
+                }
+                p++;
+        }
+        return 0;
+}
+
+/* search PREFIX SUBSTRING [options]: rows whose request path contains it */
+static void search_command(int argc, char *argv[])
+{
+        struct query q;
+        struct query_column *c = NULL;
+        const char *needle;
+        size_t len, i;
+        unsigned char head[TRIGRAM_HEADER_SIZE];
+        unsigned char *candidates, *found;
+        unsigned long blocks, count, b, row, scanned = 0;
+        FILE *index;
+
+        memset(&q, 0, sizeof(q));
+        if (argc < 4) {
+                error(err_missing_option_value);
+        }
+        q.prefix = argv[2];
+        needle = argv[3];
+        len = strlen(needle);
+        query_read_schema(&q);
+        for (i = 4; i < (size_t)argc; i++) {
+                if (!strcmp(argv[i], "--stats")) {
+                        q.stats = 1;
+                } else if (!strcmp(argv[i], "--dictionary")
+                           && i + 1 < (size_t)argc) {
+                        query_open_dictionary(&q, argv[++i]);
+                } else {
+                        error(err_unknown_option);
+                }
+        }
+        for (i = 0; i < q.columns_count && !c; i++) {
+                if (!strcmp(q.columns[i].name, "path")) {
+                        c = &q.columns[i];
+                }
+        }
+        if (!c) {
+                c = query_column(&q, "request");
+        }
+        c->used = 1;
+        query_bind_dictionary(&q);
+
+        index = query_open(&q, "trigrams", "bin");
+        blocks = (q.rows + COLUMNAR_BLOCK_ROWS - 1) / COLUMNAR_BLOCK_ROWS;
+        if (fread(head, 1, sizeof(head), index) != sizeof(head)
+            || memcmp(head, "ALTG", 4)
+            || read_u32(head + 4) != TRIGRAM_VERSION
+            || read_u32(head + 8) != blocks) {
+                error(err_wrong_trigram_file);
+        }
+        count = read_u32(head + 12);
+        candidates = xmalloc(blocks + 1);
+        found = xmalloc(blocks + 1);
+        memset(candidates, 1, blocks + 1);
+        for (i = 0; i + 3 <= len; i++) {
+                trigram_intersect(index,
+                                  count,
+                                  trigram_at(needle + i),
+                                  candidates,
+                                  found,
+                                  blocks);
+        }
+        fclose(index);
+
+        for (b = 0; b < blocks; b++) {
+                unsigned long first = b * COLUMNAR_BLOCK_ROWS;
+                unsigned long rows = q.rows - first < COLUMNAR_BLOCK_ROWS
+                                         ? q.rows - first
+                                         : COLUMNAR_BLOCK_ROWS;
+
+                if (!candidates[b]) {
+                        continue;
+                }
+                scanned++;
+                query_load(&q, c, first, rows);
+                for (row = 0; row < rows; row++) {
+                        struct span v = query_string(c, row);
+                        struct span path = strcmp(c->name, "path")
+                                               ? path_of_request(&v)
+                                               : v;
+
+                        if (span_contains(path, needle, len)) {
+                                printf("%lu\t%.*s\n",
+                                       first + row,
+                                       (int)v.len,
+                                       v.ptr);
+                        }
+                }
+        }
+        free(candidates);
+        free(found);
+        if (q.stats) {
+                fprintf(stderr, "blocks\t%lu\n", blocks);
+                fprintf(stderr, "blocks_scanned\t%lu\n", scanned);
+        }
+}
+
+/*
+ * Replay of a log at its original pacing for load tests.  Lines are put into
+ * a timer wheel with a slot per second of log time, so lines logged up to
+ * --reorder seconds out of order still go out in time order.  The lines of a
+ * second are spread evenly over it, as logs have no finer times.
+ *
+ * POSIX builds sleep until lines are due on the monotonic clock, and report
+ * the lag of lines behind their schedule.  C90 has no sleep and no wall clock
+ * finer than seconds, so other builds spin on time(), keeping a processor
+ * busy while they wait, and send the lines of a second once it began, without
+ * lag, which would only measure that.
+ */
+
+#define DEFAULT_REPLAY_REORDER 2
+
+struct replay_event {
+        char *text;
+        size_t len;
+        size_t cap;
+        long next; /* in slot or free list, -1 at the end */
+};
+
+struct replay_slot {
+        long head;
+        long tail;
+        unsigned long count;
+};
+
+struct replay {
+        struct replay_event *events;
+        size_t events_len;
+        size_t events_cap;
+        long free;
+        struct replay_slot *slots;
+        unsigned long slots_mask;
+        unsigned long queued;
+        double speed;
+        const char *http_host;
+        enum duration_format duration;
+#ifdef POSIX_2001
+        struct timespec started;
+#else
+        time_t started;
+#endif
+        struct histogram lag;
+};
+
+static void replay_push(struct replay *p, long t, const char *line, size_t len)
+{
+        struct replay_slot *slot = &p->slots[(unsigned long)t & p->slots_mask];
+        struct replay_event *e;
+        long i = p->free;
+
+        if (i >= 0) {
+                p->free = p->events[i].next;
+        } else {
+                p->events = grow_copy(p->events,
+                                      &p->events_cap,
+                                      p->events_len,
+                                      sizeof(*p->events));
+                i = (long)p->events_len++;
+                memset(&p->events[i], 0, sizeof(*p->events));
+        }
+        e = &p->events[i];
+        if (len > e->cap) {
+                free(e->text);
+                e->cap = len * 2;
+                e->text = xmalloc(e->cap);
+        }
+        memcpy(e->text, line, len);
+        e->len = len;
+        e->next = -1;
+        if (slot->tail >= 0) {
+                p->events[slot->tail].next = i;
+        } else {
+                slot->head = i;
+        }
+        slot->tail = i;
+        slot->count++;
+        p->queued++;
+}
+
+static void replay_start(struct replay *p)
+{
+#ifdef POSIX_2001
+        clock_gettime(CLOCK_MONOTONIC, &p->started);
+#else
+        p->started = time(NULL);
+#endif
+}
+
+/* Seconds of wall time since the start of the replay */
+static double replay_elapsed(const struct replay *p)
+{
+#ifdef POSIX_2001
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (double)(now.tv_sec - p->started.tv_sec)
+               + (double)(now.tv_nsec - p->started.tv_nsec) / 1e9;
+#else
+        return difftime(time(NULL), p->started);
+#endif
+}
+
+/* Waits until due, and returns the time it is then */
+static double replay_wait(const struct replay *p, double due)
+{
+        double now = replay_elapsed(p);
+
+#ifdef POSIX_2001
+        while (now < due) {
+                struct timespec left;
+
+                left.tv_sec = (time_t)(due - now);
+                left.tv_nsec = (long)((due - now - (double)left.tv_sec) * 1e9);
+                nanosleep(&left, NULL);
+                now = replay_elapsed(p);
+        }
+#else
+        /* Whole seconds only, so until the second of due began */
+        while (now + 1 <= due) {
+                now = replay_elapsed(p);
+        }
+#endif
+        return now;
+}
+
+static void replay_write(const struct replay *p, const char *line)
+{
+        struct record r;
+        struct options o;
+
+        memset(&o, 0, sizeof(o));
+        o.duration = p->duration;
+        parse_line(line, &o, &r);
+        if (!p->http_host) {
+                print_span(&r.fields[FIELD_REQUEST]);
+                out_end_line();
+                return;
+        }
+        print_span(&r.fields[FIELD_REQUEST]);
+        out_str("\r\nHost: ");
+        out_str(p->http_host);
+        out_str("\r\nUser-Agent: ");
+        print_span(&r.fields[FIELD_AGENT]);
+        out_str("\r\n\r\n");
+}
+
+/* Writes the lines of second t, spread over it */
+static void replay_slot(struct replay *p, long t, long first)
+{
+        struct replay_slot *slot = &p->slots[(unsigned long)t & p->slots_mask];
+        unsigned long i, n = slot->count;
+        long e;
+
+        for (i = 0, e = slot->head; e >= 0; i++) {
+                long next = p->events[e].next;
+                double due = ((double)(t - first) + (double)i / (double)n)
+                             / p->speed;
+                double now = replay_elapsed(p);
+
+                if (now < due) {
+                        out_flush();
+                        now = replay_wait(p, due);
+                }
+                /* Due within the second, which began, in C90 builds */
+                hist_add(&p->lag,
+                         now > due ? (unsigned long)((now - due) * 1e6) : 0);
+                replay_write(p, p->events[e].text);
+                p->events[e].next = p->free;
+                p->free = e;
+                e = next;
+        }
+        out_flush();
+        p->queued -= n;
+        slot->head = -1;
+        slot->tail = -1;
+        slot->count = 0;
+}
+
+/*
+ * replay [--speed X] [--reorder SECONDS] [--http HOST] [--duration %D|%T]
+ *        [--input FILE]
+ */
+static void replay_command(int argc, char *argv[])
+{
+        struct replay p;
+        FILE *in = stdin;
+        char line_buf[4096];
+        struct record r;
+        struct options o;
+        long reorder = DEFAULT_REPLAY_REORDER, first = 0, t = 0, now = 0;
+        int pending = 0, started = 0, i;
+        unsigned long slots = 1;
+
+        memset(&p, 0, sizeof(p));
+        memset(&o, 0, sizeof(o));
+        p.speed = 1;
+        p.free = -1;
+        for (i = 2; i < argc; i += 2) {
+                const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+                char *end = NULL;
+
+                if (!value) {
+                        error(err_missing_option_value);
+                }
+                if (!strcmp(argv[i], "--speed")) {
+                        p.speed = strtod(value, &end);
+                        if (*end || p.speed <= 0) {
+                                error(err_wrong_option_value);
+                        }
+                } else if (!strcmp(argv[i], "--reorder")) {
+                        reorder = strtol(value, &end, 10);
+                        if (*end || reorder < 0 || reorder > 3600) {
+                                error(err_wrong_option_value);
+                        }
+                } else if (!strcmp(argv[i], "--http")) {
+                        p.http_host = value;
+                } else if (!strcmp(argv[i], "--input")) {
+                        in = xfopen(value, "rb");
+                } else if (!strcmp(argv[i], "--duration")) {
+                        p.duration = parse_duration_format(value);
+                } else {
+                        error(err_unknown_option);
+                }
+        }
+        o.duration = p.duration;
+        while (slots <= (unsigned long)reorder + 1) {
+                slots *= 2;
+        }
+        p.slots = xmalloc(slots * sizeof(*p.slots));
+        p.slots_mask = slots - 1;
+        for (i = 0; i < (int)slots; i++) {
+                p.slots[i].head = -1;
+                p.slots[i].tail = -1;
+                p.slots[i].count = 0;
+        }
+
+        replay_start(&p);
+        for (;;) {
+                if (pending && t <= now + reorder) {
+                        replay_push(&p, t, line_buf, strlen(line_buf) + 1);
+                        pending = 0;
+                }
+                /* Queues lines up to reorder seconds ahead of the slot due */
+                while (!pending && fgets(line_buf, sizeof(line_buf), in)) {
+                        if (!memchr(line_buf, '\n', sizeof(line_buf))) {
+                                error(err_line_is_too_long);
+                        }
+                        if (*line_buf == '\n') {
+                                continue;
+                        }
+                        parse_line(line_buf, &o, &r);
+                        t = record_epoch(&r);
+                        /* Earlier lines may still come after the first */
+                        if (!started) {
+                                first = now = t - reorder;
+                                started = 1;
+                        }
+                        if (t > now + reorder) {
+                                pending = 1;
+                        } else {
+                                replay_push(&p,
+                                            t < now ? now : t,
+                                            line_buf,
+                                            strlen(line_buf) + 1);
+                        }
+                }
+                if (!p.queued && !pending) {
+                        break;
+                }
+                if (p.queued) {
+                        replay_slot(&p, now, first);
+                        now++;
+                } else {
+                        /* Nothing in the window, on to the pending line */
+                        now = t - reorder;
+                }
+        }
+        if (ferror(in)) {
+                error(err_input_read_error);
+        }
+
+        out_finish();
+        fprintf(stderr, "lines\t%lu\n", p.lag.count);
+#ifdef POSIX_2001
+        fprintf(stderr, "lag_p50_us\t%lu\n", hist_percentile(&p.lag, 50));
+        fprintf(stderr, "lag_p90_us\t%lu\n", hist_percentile(&p.lag, 90));
+        fprintf(stderr, "lag_p99_us\t%lu\n", hist_percentile(&p.lag, 99));
+        fprintf(stderr, "lag_max_us\t%lu\n", p.lag.max);
+#endif
+}
+
+/*
+ * Record stream: parsed lines published for other local consumers, so that
+ * they need no parser of their own.  Written to a file or a named pipe:
+ *
+ *   "ALTR", version, number of fields per record (u32 each)
+ *   records:
+ *     line length (u32), offset and length of each field in the line
+ *     (u32 each, in the order of enum field), line without newline
+ */
+
+#define RECORDS_VERSION 1
+#define RECORDS_HEADER_SIZE 12
+
+static void records_open(FILE *out)
+{
+        fwrite("ALTR", 1, 4, out);
+        write_u32(out, RECORDS_VERSION);
+        write_u32(out, FIELD_COUNT);
+}
+
+static void records_write(FILE *out, const char *line, const struct record *r)
+{
+        size_t len = strcspn(line, "\n");
+        int i;
+
+        write_u32(out, len);
+        for (i = 0; i < FIELD_COUNT; i++) {
+                const struct span *f = &r->fields[i];
+
+                write_u32(out, f->ptr ? (unsigned long)(f->ptr - line) : 0);
+                write_u32(out, f->ptr ? f->len : 0);
+        }
+        fwrite(line, 1, len, out);
+}
+
+/* records FILE: prints raw fields of a record stream, a reference consumer */
+static void records_command(const char *path)
+{
+        FILE *in = strcmp(path, "-") ? xfopen(path, "rb") : stdin;
+        unsigned char head[RECORDS_HEADER_SIZE];
+        unsigned char fields[FIELD_COUNT * 8];
+        char line_buf[4096];
+        int i;
+
+        if (fread(head, 1, sizeof(head), in) != sizeof(head)
+            || memcmp(head, "ALTR", 4) || read_u32(head + 4) != RECORDS_VERSION
+            || read_u32(head + 8) != FIELD_COUNT) {
+                error(err_wrong_records_file);
+        }
+        for (;;) {
+                size_t got = fread(head, 1, 4, in);
+                unsigned long len;
+
+                if (!got && !ferror(in)) {
+                        break;
+                }
+                len = got == 4 ? read_u32(head) : 0;
+                if (len >= sizeof(line_buf)) {
+                        error(err_wrong_records_file);
+                }
+                /* A stream ending inside a record is not a shorter file */
+                if (got != 4
+                    || fread(fields, 1, sizeof(fields), in) != sizeof(fields)
+                    || fread(line_buf, 1, len, in) != len) {
+                        error(ferror(in) ? err_input_read_error
+                                         : err_truncated_records_file);
+                }
+                for (i = 0; i < FIELD_COUNT; i++) {
+                        unsigned long off = read_u32(fields + i * 8);
+                        unsigned long n = read_u32(fields + i * 8 + 4);
+
+                        if (off + n > len) {
+                                error(err_wrong_records_file);
+                        }
+                        if (i) {
+                                out_char('\t');
+                        }
+                        out_bytes(line_buf + off, n);
+                }
+                out_end_line();
+        }
+        out_finish();
+}
+
+/* Latency histograms per (endpoint, status class, minute) */
+
+static void latency_add(struct map *m, const struct record *r, char *key_buf)
+{
+        static const char *fmt_minute = "%Y-%m-%dT%H:%M";
+
+        struct span path = request_path(r);
+        const struct span *status = &r->fields[FIELD_STATUS];
+        struct histogram *h;
+        char *k = key_buf;
+
+        memcpy(k, path.ptr, path.len);
+        k += path.len;
+        *k++ = '\t';
+        *k++ = status->len && isdigit(*status->ptr) ? *status->ptr : '-';
+        *k++ = 'x';
+        *k++ = 'x';
+        *k++ = '\t';
+        if (!strftime(k, 32, fmt_minute, &r->time)) {
+                error(err_time_buffer_size_exceeded);
+        }
+
+        h = map_get(m, key_buf);
+        if (!h) {
+                h = xcalloc(1, sizeof(*h));
+                map_put(m, xstrdup(key_buf), h);
+        }
+        hist_add(h, r->duration_us);
+}
+
+static void latency_write_summary(const struct map *m, FILE *out)
+{
+        struct map_entry *entries = map_sorted(m);
+        size_t i;
+
+        fprintf(out,
+                "endpoint\t"
+                "class\t"
+                "minute\t"
+                "count\t"
+                "p50\t"
+                "p90\t"
+                "p99\t"
+                "max\n");
+        for (i = 0; i < m->len; i++) {
+                const struct histogram *h = entries[i].value;
+
+                fprintf(out,
+                        "%s\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+                        entries[i].key,
+                        h->count,
+                        hist_percentile(h, 50),
+                        hist_percentile(h, 90),
+                        hist_percentile(h, 99),
+                        h->max);
+        }
+        free(entries);
+}
+
+/*
+ * Aggregate state files keep partial aggregates, which are merged later
+ * without rescanning logs:
+ *
+ *   "ALTS", version, histogram sub-bucket bits and max exponent (u32 each)
+ *   records till the end of file:
+ *     type, key length (u32 each), key
+ *     STATE_LATENCY: count, max (u64 each), number of non-empty buckets (u32),
+ *                    bucket index (u32) and count (u64) for each of them
+ *
+ * New aggregation types get their own record type, a change of layout of
+ * an existing one bumps the version.
+ */
+
+#define STATE_VERSION 1
+#define STATE_HEADER_SIZE 16
+
+enum state_record_type {
+        STATE_LATENCY = 1
+};
+
+struct state_reader {
+        const unsigned char *p;
+        const unsigned char *end;
+};
+
+static const unsigned char *state_take(struct state_reader *r, size_t n)
+{
+        const unsigned char *p = r->p;
+
+        if ((size_t)(r->end - r->p) < n) {
+                error(err_wrong_state_file);
+        }
+        r->p += n;
+        return p;
+}
+
+static unsigned long state_u32(struct state_reader *r)
+{
+        return read_u32(state_take(r, 4));
+}
+
+static unsigned long state_u64(struct state_reader *r)
+{
+        const unsigned char *p = state_take(r, 8);
+
+        return read_u32(p) | (read_u32(p + 4) << 16) << 16;
+}
+
+static void state_write(const struct map *latency, const char *path)
+{
+        struct map_entry *entries = map_sorted(latency);
+        FILE *out = xfopen(path, "wb");
+        size_t i;
+
+        fwrite("ALTS", 1, 4, out);
+        write_u32(out, STATE_VERSION);
+        write_u32(out, HIST_SUB_BITS);
+        write_u32(out, HIST_MAX_EXP);
+        for (i = 0; i < latency->len; i++) {
+                const struct histogram *h = entries[i].value;
+                unsigned long nonempty = 0;
+                unsigned b;
+
+                for (b = 0; b < HIST_BUCKETS; b++) {
+                        nonempty += h->buckets[b] != 0;
+                }
+                write_u32(out, STATE_LATENCY);
+                write_u32(out, strlen(entries[i].key));
+                fwrite(entries[i].key, 1, strlen(entries[i].key), out);
+                write_u64(out, h->count);
+                write_u64(out, h->max);
+                write_u32(out, nonempty);
+                for (b = 0; b < HIST_BUCKETS; b++) {
+                        if (h->buckets[b]) {
+                                write_u32(out, b);
+                                write_u64(out, h->buckets[b]);
+                        }
+                }
+        }
+        xfclose_synced(out);
+        free(entries);
+}
+
+/* Adds up all aggregates from the state file into the maps given */
+static void state_merge(const char *path, struct map *latency)
+{
+        size_t size;
+        unsigned char *data = read_file(path, &size);
+        struct state_reader r;
+        struct histogram h;
+
+        r.p = data;
+        r.end = data + size;
+        if (memcmp(state_take(&r, 4), "ALTS", 4)
+            || state_u32(&r) != STATE_VERSION
+            || state_u32(&r) != HIST_SUB_BITS
+            || state_u32(&r) != HIST_MAX_EXP) {
+                error(err_wrong_state_file);
+        }
+        while (r.p < r.end) {
+                unsigned long type = state_u32(&r);
+                unsigned long key_len = state_u32(&r);
+                char *key = xmalloc(key_len + 1);
+                struct histogram *dst;
+                unsigned long n;
+
+                memcpy(key, state_take(&r, key_len), key_len);
+                key[key_len] = '\0';
+                if (type != STATE_LATENCY) {
+                        error(err_wrong_state_file);
+                }
+                memset(&h, 0, sizeof(h));
+                h.count = state_u64(&r);
+                h.max = state_u64(&r);
+                for (n = state_u32(&r); n; n--) {
+                        unsigned long b = state_u32(&r);
+
+                        if (b >= HIST_BUCKETS) {
+                                error(err_wrong_state_file);
+                        }
+                        h.buckets[b] = state_u64(&r);
+                }
+
+                dst = map_get(latency, key);
+                if (dst) {
+                        free(key);
+                } else {
+                        dst = xcalloc(1, sizeof(*dst));
+                        map_put(latency, key, dst);
+                }
+                hist_merge(dst, &h);
+        }
+        free(data);
+}
+
+/*
+ * Rollup store: a directory with a state file per day and a MANIFEST, which
+ * is the only file replaced in place:
+ *
+ *   generation  N
+ *   day         YYYY-MM-DD, generation of its partition
+ *   input       consumed bytes, size of the file and hash of its first bytes
+ *               (up to ROLLUP_HEAD_SIZE of the consumed ones) at the time,
+ *               and path
+ *
+ * fields separated by tabs.  The partition of a day is YYYY-MM-DD.G.state,
+ * written by the run of generation G.  A run writes partitions of the days
+ * with new data as new files of the next generation, and commits them with
+ * checkpoints of its input by renaming a new MANIFEST into place.  Partitions
+ * of other generations than the MANIFEST names are leftovers of runs which
+ * did not commit, or older ones, and are ignored.
+ *
+ * A run picks up each input from its checkpoint.  An input which got shorter
+ * or starts differently was replaced, by rotation for example, and is
+ * consumed again from its start.
+ */
+
+#define ROLLUP_HEAD_SIZE 4096
+
+struct checkpoint {
+        long offset;
+        long size;
+        unsigned long head;
+};
+
+struct rollup_manifest {
+        unsigned long generation;
+        struct map days; /* of generations */
+        struct map checkpoints;
+};
+
+/* Hash of the first bytes of the input, up to ROLLUP_HEAD_SIZE of n */
+static unsigned long rollup_head_hash(FILE *in, long n)
+{
+        char buf[ROLLUP_HEAD_SIZE];
+        size_t len = n < ROLLUP_HEAD_SIZE ? (size_t)n : sizeof(buf);
+
+        rewind(in);
+        len = fread(buf, 1, len, in);
+        if (ferror(in)) {
+                error(err_input_read_error);
+        }
+        return hash_bytes(buf, len);
+}
+
+static char *rollup_path(const char *dir, const char *name)
+{
+        char *path = xmalloc(strlen(dir) + strlen(name) + 2);
+
+        sprintf(path, "%s/%s", dir, name);
+        return path;
+}
+
+static char *
+rollup_partition(const char *dir, const char *day, unsigned long generation)
+{
+        char name[64];
+
+        sprintf(name, "%.10s.%lu.state", day, generation);
+        return rollup_path(dir, name);
+}
+
+static void rollup_read_manifest(const char *dir, struct rollup_manifest *m)
+{
+        char *path = rollup_path(dir, "MANIFEST");
+        char line_buf[4096];
+        FILE *in = fopen(path, "r");
+
+        free(path);
+        memset(m, 0, sizeof(*m));
+        if (!in) {
+                return;
+        }
+        while (fgets(line_buf, sizeof(line_buf), in)) {
+                char day[16];
+                unsigned long *generation;
+                struct checkpoint *cp;
+                int name = 0;
+
+                line_buf[strcspn(line_buf, "\n")] = '\0';
+                if (sscanf(line_buf, "generation\t%lu", &m->generation) == 1) {
+                        continue;
+                }
+                if (sscanf(line_buf, "day\t%10[0-9-]\t%n", day, &name) == 1
+                    && name) {
+                        generation = xmalloc(sizeof(*generation));
+                        if (sscanf(line_buf + name, "%lu", generation) != 1) {
+                                error(err_wrong_rollup_manifest);
+                        }
+                        map_put(&m->days, xstrdup(day), generation);
+                        continue;
+                }
+                cp = xmalloc(sizeof(*cp));
+                if (sscanf(line_buf,
+                           "input\t%ld\t%ld\t%lx\t%n",
+                           &cp->offset,
+                           &cp->size,
+                           &cp->head,
+                           &name)
+                        < 3
+                    || !name) {
+                        error(err_wrong_rollup_manifest);
+                }
+                map_put(&m->checkpoints, xstrdup(line_buf + name), cp);
+        }
+        if (ferror(in)) {
+                error(err_input_read_error);
+        }
+        fclose(in);
+}
+
+/* Commits the run: partitions are on disk before the MANIFEST names them */
+static void
+rollup_write_manifest(const char *dir, const struct rollup_manifest *m)
+{
+        struct map_entry *entries;
+        char *path = rollup_path(dir, "MANIFEST");
+        char *tmp_path = rollup_path(dir, "MANIFEST.tmp");
+        FILE *out = xfopen(tmp_path, "w");
+        size_t i;
+
+        fprintf(out, "generation\t%lu\n", m->generation);
+        entries = map_sorted(&m->days);
+        for (i = 0; i < m->days.len; i++) {
+                fprintf(out,
+                        "day\t%s\t%lu\n",
+                        entries[i].key,
+                        *(const unsigned long *)entries[i].value);
+        }
+        free(entries);
+        entries = map_sorted(&m->checkpoints);
+        for (i = 0; i < m->checkpoints.len; i++) {
+                const struct checkpoint *cp = entries[i].value;
+
+                fprintf(out,
+                        "input\t%ld\t%ld\t%08lx\t%s\n",
+                        cp->offset,
+                        cp->size,
+                        cp->head,
+                        entries[i].key);
+        }
+        free(entries);
+        xfclose_synced(out);
+        remove(path);
+        if (rename(tmp_path, path)) {
+                error(err_output_write_error);
+        }
+        free(tmp_path);
+        free(path);
+}
+
+/*
+ * Returns the offset, up to which input was consumed by previous runs, or 0
+ * if it was replaced since.  Leaves input at its start.
+ */
+static long
+rollup_checkpoint(const char *dir, const char *input_path, FILE *in)
+{
+        struct rollup_manifest m;
+        const struct checkpoint *cp;
+        long offset = 0;
+
+        rollup_read_manifest(dir, &m);
+        cp = map_get(&m.checkpoints, input_path);
+        if (cp && file_size(in) >= cp->size
+            && rollup_head_hash(in, cp->offset) == cp->head) {
+                offset = cp->offset;
+        }
+        rewind(in);
+        return offset;
+}
+
+static void rollup_update(const char *dir,
+                          const struct map *latency,
+                          const char *input_path,
+                          FILE *in,
+                          long consumed)
+{
+        struct map days = {NULL, 0, 0};
+        struct rollup_manifest m;
+        struct map_entry *entries = map_sorted(latency);
+        unsigned long *previous, generation;
+        struct checkpoint *cp;
+        size_t i;
+
+        /* Keys end with the minute, which starts with the day */
+        for (i = 0; i < latency->len; i++) {
+                const char *minute = strrchr(entries[i].key, '\t') + 1;
+                char day[16] = {0};
+                struct map *partition;
+
+                strncpy(day, minute, 10);
+                partition = map_get(&days, day);
+                if (!partition) {
+                        partition = xcalloc(1, sizeof(*partition));
+                        map_put(&days, xstrdup(day), partition);
+                }
+                map_put(partition, xstrdup(entries[i].key), entries[i].value);
+        }
+        free(entries);
+
+        rollup_read_manifest(dir, &m);
+        generation = ++m.generation;
+        previous = xmalloc((days.len + 1) * sizeof(*previous));
+        entries = map_sorted(&days);
+        for (i = 0; i < days.len; i++) {
+                unsigned long *current = map_get(&m.days, entries[i].key);
+                char *path;
+
+                if (current) {
+                        path = rollup_partition(dir, entries[i].key, *current);
+                        state_merge(path, entries[i].value);
+                        free(path);
+                } else {
+                        current = xmalloc(sizeof(*current));
+                        *current = 0;
+                        map_put(&m.days, xstrdup(entries[i].key), current);
+                }
+                previous[i] = *current;
+                *current = generation;
+                path = rollup_partition(dir, entries[i].key, generation);
+                state_write(entries[i].value, path);
+                free(path);
+        }
+
+        cp = map_get(&m.checkpoints, input_path);
+        if (!cp) {
+                cp = xmalloc(sizeof(*cp));
+                map_put(&m.checkpoints, xstrdup(input_path), cp);
+        }
+        cp->offset = consumed;
+        cp->size = file_size(in);
+        cp->head = rollup_head_hash(in, consumed);
+        rollup_write_manifest(dir, &m);
+
+        /* Replaced partitions are no longer named by the MANIFEST */
+        for (i = 0; i < days.len; i++) {
+                if (previous[i]) {
+                        char *path = rollup_partition(dir,
+                                                      entries[i].key,
+                                                      previous[i]);
+
+                        remove(path);
+                        free(path);
+                }
+        }
+        free(previous);
+        free(entries);
+}
+
+/* Merges partitions of days starting with the prefix into the maps given */
+static void
+rollup_merge(const char *dir, const char *prefix, struct map *latency)
+{
+        struct rollup_manifest m;
+        struct map_entry *entries;
+        size_t i;
+
+        rollup_read_manifest(dir, &m);
+        entries = map_sorted(&m.days);
+        for (i = 0; i < m.days.len; i++) {
+                const unsigned long *generation = entries[i].value;
+
+                if (!strncmp(entries[i].key, prefix, strlen(prefix))) {
+                        char *path =
+                            rollup_partition(dir, entries[i].key, *generation);
+
+                        state_merge(path, latency);
+                        free(path);
+                }
+        }
+        free(entries);
+}
+
+/* merge [--state FILE] [--rollup DIR [--days PREFIX]] STATE... */
+static void merge_command(int argc, char *argv[])
+{
+        struct map latency = {NULL, 0, 0};
+        const char *out_path = NULL;
+        const char *rollup_dir = NULL;
+        const char *days = "";
+        int i = 2;
+
+        if (i + 1 < argc && !strcmp(argv[i], "--state")) {
+                out_path = argv[i + 1];
+                i += 2;
+        }
+        if (i + 1 < argc && !strcmp(argv[i], "--rollup")) {
+                rollup_dir = argv[i + 1];
+                i += 2;
+                if (i + 1 < argc && !strcmp(argv[i], "--days")) {
+                        days = argv[i + 1];
+                        i += 2;
+                }
+                rollup_merge(rollup_dir, days, &latency);
+        }
+        for (; i < argc; i++) {
+                state_merge(argv[i], &latency);
+        }
+        if (out_path) {
+                state_write(&latency, out_path);
+        }
+        latency_write_summary(&latency, stdout);
+}
+
+/*
+ * Apache 2.4 error log, merge-joined with access log rows by client IP and
+ * time window.  Both inputs are expected in time order, so only error
+ * entries within the window around the current row are kept in memory.
+ */
+
+#define ERROR_LINE_SIZE 4096
+
+struct error_entry {
+        long time;
+        char client[64];
+        char text[ERROR_LINE_SIZE];
+};
+
+struct error_log {
+        FILE *in;
+        long window;
+        struct error_entry *queue; /* ring buffer of entries in the window */
+        size_t cap;
+        size_t head;
+        size_t len;
+        struct error_entry next; /* read ahead, beyond the window yet */
+        int has_next;
+        char line_buf[ERROR_LINE_SIZE];
+};
+
+/* Returns the number of chars read, or 0 if s is not a valid timestamp */
+static size_t parse_error_datetime(const char *s, long *time)
+{
+        const char *start = s;
+        char mon_buf[4] = {0};
+        struct tm t = {0};
+        int chars_read = 0;
+        int args_read = sscanf(s,
+                               "%*3s %3s %2d %2d:%2d:%2d%n",
+                               mon_buf,
+                               &t.tm_mday,
+                               &t.tm_hour,
+                               &t.tm_min,
+                               &t.tm_sec,
+                               &chars_read);
+
+        if (args_read != 5) {
+                return 0;
+        }
+        s += chars_read;
+        if (*s == '.') {
+                for (s++; isdigit(*s); s++)
+                        ;
+        }
+        chars_read = 0;
+        if (sscanf(s, " %4d%n", &t.tm_year, &chars_read) != 1) {
+                return 0;
+        }
+        t.tm_year -= 1900;
+        t.tm_mon = parse_month(mon_buf);
+        *time = tm_to_seconds(&t);
+        return (size_t)(s + chars_read - start);
+}
+
+/* The ']' closing the field at s, which may have brackets like [::1]:80 */
+static char *error_field_end(char *s)
+{
+        int depth = 0;
+
+        for (; *s && *s != '\n'; s++) {
+                if (*s == '[') {
+                        depth++;
+                } else if (*s == ']' && !--depth) {
+                        return s;
+                }
+        }
+        return NULL;
+}
+
+/* Client address without port: 1.2.3.4:80, [::1]:80 or ::1 */
+static void error_client(char *client)
+{
+        char *colon = strchr(client, ':');
+        char *end;
+
+        if (*client == '[') {
+                end = strchr(client, ']');
+                if (end) {
+                        memmove(client, client + 1, (size_t)(end - client) - 1);
+                        client[end - client - 1] = '\0';
+                }
+        } else if (colon && !strchr(colon + 1, ':')) {
+                *colon = '\0';
+        }
+}
+
+/*
+ * Returns 0 for lines which can not be joined, as they have no client, and
+ * for lines which are not entries, like output of CGI scripts
+ */
+static int parse_error_line(char *s, struct error_entry *e)
+{
+        char *module = NULL;
+        char *p = s + 1;
+        size_t n = *s == '[' ? parse_error_datetime(p, &e->time) : 0;
+
+        p += n;
+        if (!n || *p != ']') {
+                return 0;
+        }
+        e->client[0] = '\0';
+        for (s = p + 1; *s == ' ' && s[1] == '['; s = p + 1) {
+                p = error_field_end(s + 1);
+                if (!p) {
+                        return 0;
+                }
+                s += 2;
+                if (!strncmp(s, "client ", 7)) {
+                        size_t len = (size_t)(p - s) - 7;
+
+                        if (len >= sizeof(e->client)) {
+                                return 0;
+                        }
+                        memcpy(e->client, s + 7, len);
+                        e->client[len] = '\0';
+                        error_client(e->client);
+                } else if (!module && strncmp(s, "pid ", 4)) {
+                        module = s;
+                        *p = '\0';
+                }
+        }
+        if (!e->client[0]) {
+                return 0;
+        }
+        for (; *s == ' '; s++)
+                ;
+        p = s + strcspn(s, "\n");
+        *p = '\0';
+        for (p = s; *p; p++) {
+                if (*p == '\t') {
+                        *p = ' ';
+                }
+        }
+        /* Both are parts of the same line, so the text fits */
+        sprintf(e->text, "%s%s%s", module ? module : "", module ? " " : "", s);
+        return 1;
+}
+
+static int error_log_read(struct error_log *l)
+{
+        while (fgets(l->line_buf, sizeof(l->line_buf), l->in)) {
+                if (!memchr(l->line_buf, '\n', sizeof(l->line_buf))) {
+                        error(err_line_is_too_long);
+                }
+                if (*l->line_buf == '\n') {
+                        continue;
+                }
+                if (parse_error_line(l->line_buf, &l->next)) {
+                        return 1;
+                }
+        }
+        if (!feof(l->in)) {
+                error(err_input_read_error);
+        }
+        return 0;
+}
+
+static void error_log_push(struct error_log *l)
+{
+        if (l->len == l->cap) {
+                struct error_entry *q;
+                size_t i;
+
+                q = xcalloc(l->cap ? l->cap * 2 : 16, sizeof(*q));
+                for (i = 0; i < l->len; i++) {
+                        q[i] = l->queue[(l->head + i) % l->cap];
+                }
+                free(l->queue);
+                l->queue = q;
+                l->cap = l->cap ? l->cap * 2 : 16;
+                l->head = 0;
+        }
+        l->queue[(l->head + l->len) % l->cap] = l->next;
+        l->len++;
+}
+
+static int error_matches(const struct error_entry *e, const struct record *r)
+{
+        const struct span *host = &r->fields[FIELD_HOST];
+
+        return strlen(e->client) == host->len
+               && !memcmp(e->client, host->ptr, host->len);
+}
+
+/* Sets r->errors to all error messages of the same client within window */
+static void
+error_log_join(struct error_log *l, struct record *r, struct arena *scratch)
+{
+        long t = tm_to_seconds(&r->time);
+        size_t i, len = 0;
+        char *joined;
+
+        while (l->has_next && l->next.time <= t + l->window) {
+                error_log_push(l);
+                l->has_next = error_log_read(l);
+        }
+        while (l->len && l->queue[l->head].time < t - l->window) {
+                l->head = (l->head + 1) % l->cap;
+                l->len--;
+        }
+
+        for (i = 0; i < l->len; i++) {
+                const struct error_entry *e = &l->queue[(l->head + i) % l->cap];
+
+                if (error_matches(e, r)) {
+                        len += strlen(e->text) + 3;
+                }
+        }
+        if (!len) {
+                r->errors.ptr = "-";
+                r->errors.len = 1;
+                return;
+        }
+
+        joined = arena_alloc(scratch, len);
+        r->errors.ptr = joined;
+        for (i = 0; i < l->len; i++) {
+                const struct error_entry *e = &l->queue[(l->head + i) % l->cap];
+
+                if (error_matches(e, r)) {
+                        joined += sprintf(joined,
+                                          "%s%s",
+                                          joined > r->errors.ptr ? " | " : "",
+                                          e->text);
+                }
+        }
+        r->errors.len = (size_t)(joined - r->errors.ptr);
+}
+
+static void error_log_open(struct error_log *l, const char *path, long window)
+{
+        memset(l, 0, sizeof(*l));
+        l->in = xfopen(path, "r");
+        l->window = window;
+        l->has_next = error_log_read(l);
+}
+
+/*
+ * Lookup tables are built once from CSV into an immutable hash file:
+ *
+ *   "ALTL", version, slot count, heap size (u32 each)
+ *   slots: key hash and heap offset + 1 of the key (u32 each, 0 if empty)
+ *   heap: key '\0' value '\0' ...
+ *
+ * Loading is a single read, no per-entry work is needed before lookups.
+ */
+
+#define LOOKUP_VERSION 1
+#define LOOKUP_HEADER_SIZE 16
+
+static void lookup_build(const char *csv_path, const char *out_path)
+{
+        char line_buf[4096];
+        struct map table = {NULL, 0, 0};
+        struct map_entry *entries;
+        unsigned long slots = 1, heap_size = 0, offset = 0;
+        unsigned long *index;
+        FILE *in = xfopen(csv_path, "r");
+        FILE *out;
+        size_t i;
+
+        while (fgets(line_buf, sizeof(line_buf), in)) {
+                char *comma = strchr(line_buf, ',');
+                char *p;
+
+                if (!memchr(line_buf, '\n', sizeof(line_buf)) && !feof(in)) {
+                        error(err_line_is_too_long);
+                }
+                line_buf[strcspn(line_buf, "\r\n")] = '\0';
+                if (!line_buf[0]) {
+                        continue;
+                }
+                if (!comma) {
+                        error(err_wrong_lookup_line_format);
+                }
+                *comma = '\0';
+                for (p = comma + 1; *p; p++) {
+                        if (*p == '\t') {
+                                *p = ' ';
+                        }
+                }
+                if (!map_get(&table, line_buf)) {
+                        heap_size += strlen(line_buf) + strlen(comma + 1) + 2;
+                        map_put(&table, xstrdup(line_buf), xstrdup(comma + 1));
+                }
+        }
+        if (!feof(in)) {
+                error(err_input_read_error);
+        }
+        fclose(in);
+
+        while (slots < table.len * 2) {
+                slots *= 2;
+        }
+        index = xcalloc(slots * 2, sizeof(*index));
+        entries = map_sorted(&table);
+        for (i = 0; i < table.len; i++) {
+                const char *key = entries[i].key;
+                unsigned long h = hash_bytes(key, strlen(key));
+                unsigned long j = h & (slots - 1);
+
+                while (index[j * 2 + 1]) {
+                        j = (j + 1) & (slots - 1);
+                }
+                index[j * 2] = h;
+                index[j * 2 + 1] = offset + 1;
+                offset += strlen(key) + strlen(entries[i].value) + 2;
+        }
+
+        out = xfopen(out_path, "wb");
+        fwrite("ALTL", 1, 4, out);
+        write_u32(out, LOOKUP_VERSION);
+        write_u32(out, slots);
+        write_u32(out, heap_size);
+        for (i = 0; i < slots * 2; i++) {
+                write_u32(out, index[i]);
+        }
+        for (i = 0; i < table.len; i++) {
+                fwrite(entries[i].key, 1, strlen(entries[i].key) + 1, out);
+                fwrite(entries[i].value, 1, strlen(entries[i].value) + 1, out);
+        }
+        xfclose(out);
+}
+
+/* Parses NAME=FIELD:FILE and loads the table */
+static void lookup_open(struct lookup *l, const char *spec)
+{
+        char *name = xstrdup(spec);
+        char *field = strchr(name, '=');
+        char *path = field ? strchr(field, ':') : NULL;
+        unsigned long i;
+        size_t size;
+
+        if (!path || field == name) {
+                error(err_wrong_option_value);
+        }
+        *field++ = '\0';
+        *path++ = '\0';
+        l->name = name;
+        l->field = field_by_name(field);
+
+        l->data = read_file(path, &size);
+        if (size < LOOKUP_HEADER_SIZE || memcmp(l->data, "ALTL", 4)
+            || read_u32(l->data + 4) != LOOKUP_VERSION) {
+                error(err_wrong_lookup_file);
+        }
+        l->slots = read_u32(l->data + 8);
+        l->heap_size = read_u32(l->data + 12);
+        l->heap = l->data + LOOKUP_HEADER_SIZE + l->slots * 8;
+        if (!l->slots || l->slots & (l->slots - 1)
+            || l->slots > (size - LOOKUP_HEADER_SIZE) / 8
+            || size != LOOKUP_HEADER_SIZE + l->slots * 8 + l->heap_size
+            || (l->heap_size && l->heap[l->heap_size - 1])) {
+                error(err_wrong_lookup_file);
+        }
+        /* Both strings of every entry must end inside the heap */
+        for (i = 0; i < l->slots; i++) {
+                unsigned long offset =
+                    read_u32(l->data + LOOKUP_HEADER_SIZE + i * 8 + 4);
+
+                if (offset && (offset > l->heap_size
+                               || offset + strlen((const char *)l->heap
+                                                  + offset - 1)
+                                      >= l->heap_size)) {
+                        error(err_wrong_lookup_file);
+                }
+        }
+}
+
+static int lookup_exact(const struct lookup *l,
+                        const char *key,
+                        size_t len,
+                        struct span *value)
+{
+        unsigned long h = hash_bytes(key, len);
+        unsigned long i = h & (l->slots - 1);
+        unsigned long probes;
+
+        /* Bounded, as a corrupt file may have no empty slot */
+        for (probes = 0; probes < l->slots;
+             probes++, i = (i + 1) & (l->slots - 1)) {
+                const unsigned char *slot =
+                    l->data + LOOKUP_HEADER_SIZE + i * 8;
+                unsigned long offset = read_u32(slot + 4);
+                const char *k;
+
+                if (!offset) {
+                        return 0;
+                }
+                k = (const char *)l->heap + offset - 1;
+                if (read_u32(slot) == h && !strncmp(k, key, len) && !k[len]) {
+                        value->ptr = k + len + 1;
+                        value->len = strlen(value->ptr);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/* Paths are matched by the longest prefix ending before a '/' */
+static void lookup_join(const struct lookup *l,
+                        const struct record *r,
+                        struct span *value)
+{
+        struct span key = record_field(r, l->field);
+
+        if (lookup_exact(l, key.ptr, key.len, value)) {
+                return;
+        }
+        if (l->field == FIELD_PATH) {
+                while (key.len > 1) {
+                        for (key.len--; key.len && key.ptr[key.len] != '/';
+                             key.len--)
+                                ;
+                        if (lookup_exact(
+                                l, key.ptr, key.len ? key.len : 1, value)) {
+                                return;
+                        }
+                }
+        }
+        value->ptr = "-";
+        value->len = 1;
+}
+
+/*
+ * Byte range sharding: a range converts exactly the lines whose first byte
+ * falls into [start, end), so a partial first line belongs to the previous
+ * range and the last line is finished past the end.  Concatenated outputs of
+ * adjacent ranges are the same as the output of a full run.
+ */
+
+static long parse_offset(const char *s, const char **end)
+{
+        char *e = NULL;
+        long v = strtol(s, &e, 10);
+
+        if (e == s || v < 0) {
+                error(err_wrong_option_value);
+        }
+        *end = e;
+        return v;
+}
+
+static void parse_range(const char *s, long *start, long *end)
+{
+        *start = parse_offset(s, &s);
+        if (*s != ':') {
+                error(err_wrong_option_value);
+        }
+        s++;
+        *end = *s ? parse_offset(s, &s) : -1;
+        if (*s || (*end >= 0 && *end < *start)) {
+                error(err_wrong_option_value);
+        }
+}
+
+/* Positions in at the first line starting at or after offset */
+static void seek_to_line(FILE *in, long offset)
+{
+        int c;
+
+        if (!offset) {
+                return;
+        }
+        if (fseek(in, offset - 1, SEEK_SET)) {
+                error(err_input_is_not_seekable);
+        }
+        while ((c = getc(in)) != '\n' && c != EOF)
+                ;
+}
+
+/*
+ * Finds an offset at or before the first line with time at or after from,
+ * by binary search over the byte range of time-ordered input.
+ */
+static long find_time(FILE *in, long lo, long from, const struct options *o)
+{
+        char line_buf[4096];
+        long hi = file_size(in);
+        struct record r;
+
+        while (hi - lo > (long)sizeof(line_buf)) {
+                long mid = lo + (hi - lo) / 2;
+
+                seek_to_line(in, mid);
+                if (!fgets(line_buf, sizeof(line_buf), in)) {
+                        hi = mid;
+                        continue;
+                }
+                if (!memchr(line_buf, '\n', sizeof(line_buf))) {
+                        error(err_line_is_too_long);
+                }
+                if (*line_buf == '\n') {
+                        lo = mid;
+                        continue;
+                }
+                parse_line(line_buf, o, &r);
+                if (tm_to_seconds(&r.time) < from) {
+                        lo = mid;
+                } else {
+                        hi = mid;
+                }
+        }
+        return lo;
+}
+
+/* Prints n ranges of about the same size covering the whole file */
+static void print_manifest(const char *path, long n)
+{
+        FILE *in = xfopen(path, "rb");
+        unsigned long size, split, rest, carry = 0, start = 0;
+        long i;
+
+        size = (unsigned long)file_size(in);
+        fclose(in);
+        split = size / (unsigned long)n;
+        rest = size % (unsigned long)n;
+        /*
+         * Ends at size * i / n, with the remainder spread by a running carry
+         * as rest * i overflows a 32-bit long for large inputs and counts
+         */
+        for (i = 1; i <= n; i++) {
+                unsigned long end;
+
+                carry += rest;
+                end = start + split + carry / (unsigned long)n;
+                carry %= (unsigned long)n;
+                printf("%lu:%lu\n", start, end);
+                start = end;
+        }
+}
+
+/*
+ * Multiple inputs, listed one path per line in a file or found in a directory,
+ * are read one after another in the order of the time of their first lines,
+ * so rotated logs come out in time order whatever their names.
+ */
+
+struct input_file {
+        char *path;
+        long first; /* time of the first line */
+};
+
+struct inputs {
+        struct input_file *files;
+        size_t count;
+        size_t next;
+        size_t buffer; /* of --input-buffer */
+        size_t drop_behind;
+};
+
+/* Shell-style pattern with '*' and '?' */
+static int glob_match(const char *pattern, const char *s)
+{
+        for (; *pattern; pattern++, s++) {
+                if (*pattern == '*') {
+                        for (; *s; s++) {
+                                if (glob_match(pattern + 1, s)) {
+                                        return 1;
+                                }
+                        }
+                        return glob_match(pattern + 1, s);
+                }
+                if (!*s || (*pattern != '?' && *pattern != *s)) {
+                        return 0;
+                }
+        }
+        return !*s;
+}
+
+static const char *base_name(const char *path)
+{
+        const char *slash = strrchr(path, '/');
+
+        return slash ? slash + 1 : path;
+}
+
+/* Empty inputs go first, as if they started at the epoch */
+static long input_first_time(const char *path, const struct options *o)
+{
+        FILE *in = xfopen(path, "rb");
+        char line_buf[4096];
+        struct record r;
+        long first = 0;
+
+        if (fgets(line_buf, sizeof(line_buf), in) && *line_buf != '\n') {
+                parse_line(line_buf, o, &r);
+                first = record_epoch(&r);
+        }
+        fclose(in);
+        return first;
+}
+
+static int compare_inputs(const void *a, const void *b)
+{
+        const struct input_file *x = a;
+        const struct input_file *y = b;
+
+        if (x->first != y->first) {
+                return x->first < y->first ? -1 : 1;
+        }
+        return strcmp(x->path, y->path);
+}
+
+/* By --inputs-match, and by --modified-since in POSIX builds */
+static int input_wanted(const char *path, const struct options *o)
+{
+#ifdef POSIX_2001
+        struct stat st;
+#endif
+
+        if (o->inputs_match
+            && !glob_match(o->inputs_match, base_name(path))) {
+                return 0;
+        }
+#ifdef POSIX_2001
+        if (!strcmp(path, "-") || (!o->inputs_dir && !o->has_modified_since)) {
+                return 1;
+        }
+        if (stat(path, &st)) {
+                error(err_failed_to_open_file);
+        }
+        /* Subdirectories and special files of --dir are left out */
+        if (o->inputs_dir && !S_ISREG(st.st_mode)) {
+                return 0;
+        }
+        return !o->has_modified_since || (long)st.st_mtime >= o->modified_since;
+#else
+        return 1;
+#endif
+}
+
+static void inputs_add(struct inputs *l,
+                       size_t *cap,
+                       const char *path,
+                       const struct options *o)
+{
+        if (!input_wanted(path, o)) {
+                return;
+        }
+        l->files = grow_copy(l->files, cap, l->count, sizeof(*l->files));
+        l->files[l->count].path = xstrdup(path);
+        l->files[l->count].first = input_first_time(path, o);
+        l->count++;
+}
+
+/* Files of --dir, except hidden ones */
+static void inputs_scan(struct inputs *l, size_t *cap, const struct options *o)
+{
+#ifdef POSIX_2001
+        DIR *dir = opendir(o->inputs_dir);
+        size_t dir_len = strlen(o->inputs_dir);
+        char *path = NULL;
+        size_t path_cap = 0;
+        struct dirent *e;
+
+        if (!dir) {
+                error(err_failed_to_open_file);
+        }
+        while ((e = readdir(dir))) {
+                size_t len = dir_len + 1 + strlen(e->d_name) + 1;
+
+                if (e->d_name[0] == '.') {
+                        continue;
+                }
+                if (len > path_cap) {
+                        free(path);
+                        path_cap = len * 2;
+                        path = xmalloc(path_cap);
+                }
+                sprintf(path, "%s/%s", o->inputs_dir, e->d_name);
+                inputs_add(l, cap, path, o);
+        }
+        closedir(dir);
+        free(path);
+#else
+        (void)l;
+        (void)cap;
+        (void)o;
+#endif
+}
+
+static void inputs_open(struct inputs *l, const struct options *o)
+{
+        size_t cap = 0;
+
+        memset(l, 0, sizeof(*l));
+        if (o->inputs_dir) {
+                inputs_scan(l, &cap, o);
+        } else {
+                FILE *list = strcmp(o->inputs_path, "-")
+                                 ? xfopen(o->inputs_path, "r")
+                                 : stdin;
+                char line_buf[4096];
+                size_t len;
+
+                while (fgets(line_buf, sizeof(line_buf), list)) {
+                        len = strcspn(line_buf, "\r\n");
+                        line_buf[len] = '\0';
+                        if (len) {
+                                inputs_add(l, &cap, line_buf, o);
+                        }
+                }
+                if (list != stdin) {
+                        fclose(list);
+                }
+        }
+        qsort(l->files, l->count, sizeof(*l->files), compare_inputs);
+        l->buffer = o->input_buffer;
+        l->drop_behind = o->drop_behind;
+}
+
+/*
+ * Larger buffers make fewer and longer reads.  Inputs are read one at a time,
+ * so they share one buffer.
+ */
+static void input_set_buffer(FILE *in, size_t size)
+{
+        static char *buffer;
+
+        if (!size) {
+                return;
+        }
+        if (!buffer) {
+                buffer = xmalloc_large(size);
+        }
+        if (setvbuf(in, buffer, _IOFBF, size)) {
+                error(err_wrong_option_value);
+        }
+}
+
+/* Advises the kernel that input is read once from start to end */
+static void input_advise(FILE *in)
+{
+#ifdef POSIX_2001
+        posix_fadvise(fileno(in), 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+        (void)in;
+#endif
+}
+
+/*
+ * Advises the kernel that input up to the current offset, or all of it, will
+ * not be read again, so archived logs do not evict the page cache of others.
+ * Inputs, which are not files, are left alone by the kernel.
+ */
+static void input_drop(FILE *in, int whole)
+{
+#ifdef POSIX_2001
+        long end = whole ? 0 : ftell(in);
+
+        if (end >= 0) {
+                posix_fadvise(fileno(in), 0, end, POSIX_FADV_DONTNEED);
+        }
+#else
+        (void)in;
+        (void)whole;
+#endif
+}
+
+/* Reads a line, going on to the next input at the end of one */
+static char *
+inputs_read_line(struct inputs *l, char *buf, int size, FILE **in)
+{
+        if (!*in) {
+                return NULL;
+        }
+        while (!fgets(buf, size, *in)) {
+                if (ferror(*in) || l->next >= l->count) {
+                        return NULL;
+                }
+                if (*in != stdin) {
+                        if (l->drop_behind) {
+                                input_drop(*in, 1);
+                        }
+                        fclose(*in);
+                }
+                *in = xfopen(l->files[l->next++].path, "rb");
+                input_set_buffer(*in, l->buffer);
+                if (l->drop_behind) {
+                        input_advise(*in);
+                }
+        }
+        return buf;
+}
+
+/*
+ * Conversion cache for rotated logs, which do not change any more.  Entries
+ * are named by the size of the input, a hash of samples of it and a hash of
+ * the options, so that a rerun only copies the output:
+ *
+ *   DIR/KEY.tsv    output
+ *   DIR/KEY.state  state of --state
+ *   DIR/KEY.hash   hash of the whole input, taken while it was converted,
+ *                  and in POSIX builds the device, inode, size and mtime of
+ *                  the input
+ *
+ * The output is written last, so entries without it are incomplete.  Hashes
+ * are 64-bit, made of two independent 32-bit ones.  A hit is checked against
+ * the hash of the whole input with --cache-verify, and in POSIX builds also
+ * if the input is not the same file as the one converted.
+ */
+
+#define CACHE_SAMPLES 16
+#define CACHE_SAMPLE_SIZE 4096
+
+struct hash64 {
+        unsigned long fnv; /* FNV-1a */
+        unsigned long oat; /* Jenkins one-at-a-time */
+};
+
+struct cache {
+        char *key; /* DIR/KEY */
+        char *path;
+        FILE *output;
+        int hit;
+        struct hash64 input; /* of lines converted */
+};
+
+static void hash64_init(struct hash64 *h)
+{
+        h->fnv = HASH_SEED;
+        h->oat = 0;
+}
+
+static void hash64_update(struct hash64 *h, const char *s, size_t len)
+{
+        unsigned long oat = h->oat;
+        size_t i;
+
+        h->fnv = hash_update(h->fnv, s, len);
+        for (i = 0; i < len; i++) {
+                oat = (oat + (unsigned char)s[i]) & 0xFFFFFFFFUL;
+                oat = (oat + (oat << 10)) & 0xFFFFFFFFUL;
+                oat ^= oat >> 6;
+        }
+        h->oat = oat;
+}
+
+/* Formats the hash as 16 hex digits into buf */
+static char *hash64_format(const struct hash64 *h, char *buf)
+{
+        unsigned long oat = h->oat;
+
+        oat = (oat + (oat << 3)) & 0xFFFFFFFFUL;
+        oat ^= oat >> 11;
+        oat = (oat + (oat << 15)) & 0xFFFFFFFFUL;
+        sprintf(buf, "%08lx%08lx", h->fnv, oat);
+        return buf;
+}
+
+static void cache_sample_hash(FILE *in, long size, struct hash64 *h)
+{
+        char buf[CACHE_SAMPLE_SIZE];
+        long i, offset;
+
+        for (i = 0; i <= CACHE_SAMPLES; i++) {
+                offset = size > CACHE_SAMPLE_SIZE
+                             ? (size - CACHE_SAMPLE_SIZE) / CACHE_SAMPLES * i
+                             : 0;
+                if (fseek(in, offset, SEEK_SET)) {
+                        error(err_input_is_not_seekable);
+                }
+                hash64_update(h, buf, fread(buf, 1, sizeof(buf), in));
+        }
+        rewind(in);
+}
+
+/* Rereads the input, if its hash could not be taken while converting it */
+static void cache_full_hash(FILE *in, struct hash64 *h)
+{
+        char buf[16384];
+        size_t n;
+
+        hash64_init(h);
+        rewind(in);
+        while ((n = fread(buf, 1, sizeof(buf), in))) {
+                hash64_update(h, buf, n);
+        }
+        if (ferror(in)) {
+                error(err_input_read_error);
+        }
+        rewind(in);
+}
+
+/*
+ * Identity of a file for the key or for a check of an entry, which changes
+ * when it is written to: device, inode, size and mtime in POSIX builds, and
+ * size and a hash of samples in others.
+ */
+static void cache_file_identity(FILE *f, char *buf)
+{
+#ifdef POSIX_2001
+        struct stat st;
+
+        if (fstat(fileno(f), &st)) {
+                error(err_input_read_error);
+        }
+        sprintf(buf,
+                "%lu %lu %ld %ld",
+                (unsigned long)st.st_dev,
+                (unsigned long)st.st_ino,
+                (long)st.st_size,
+                (long)st.st_mtime);
+#else
+        long size = file_size(f);
+        struct hash64 h;
+
+        hash64_init(&h);
+        cache_sample_hash(f, size, &h);
+        sprintf(buf, "%ld ", size);
+        hash64_format(&h, buf + strlen(buf));
+#endif
+}
+
+/*
+ * Options which do not change the output are not part of the key, files of
+ * --lookup are by their content and of --errors by their identity.
+ */
+static void cache_options_hash(const struct options *o,
+                               int argc,
+                               char *argv[],
+                               struct hash64 *h)
+{
+        char buf[128];
+        int i;
+
+        for (i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--cache") || !strcmp(argv[i], "--input")
+                    || !strcmp(argv[i], "--input-buffer")
+                    || !strcmp(argv[i], "--drop-behind")
+                    || !strcmp(argv[i], "--output-chunk")) {
+                        i++;
+                } else if (!strcmp(argv[i], "--state")) {
+                        hash64_update(h, argv[i], strlen(argv[i]) + 1);
+                        i++;
+                } else if (strcmp(argv[i], "--cache-verify")
+                           && strcmp(argv[i], "--stats")) {
+                        hash64_update(h, argv[i], strlen(argv[i]) + 1);
+                }
+        }
+        for (i = 0; i < (int)o->lookups_count; i++) {
+                const struct lookup *l = &o->lookups[i];
+
+                hash64_update(h,
+                              (const char *)l->data,
+                              LOOKUP_HEADER_SIZE + l->slots * 8
+                                  + l->heap_size);
+        }
+        if (o->errors_path) {
+                FILE *errors = xfopen(o->errors_path, "rb");
+
+                cache_file_identity(errors, buf);
+                hash64_update(h, buf, strlen(buf));
+                fclose(errors);
+        }
+}
+
+static char *cache_path(const struct cache *c, const char *suffix)
+{
+        char *path = xmalloc(strlen(c->key) + strlen(suffix) + 1);
+
+        sprintf(path, "%s%s", c->key, suffix);
+        return path;
+}
+
+static void copy_file(const char *from, const char *to)
+{
+        FILE *in = xfopen(from, "rb");
+        FILE *out = xfopen(to, "wb");
+        char buf[16384];
+        size_t n;
+
+        while ((n = fread(buf, 1, sizeof(buf), in))) {
+                if (fwrite(buf, 1, n, out) != n) {
+                        error(err_output_write_error);
+                }
+        }
+        fclose(in);
+        xfclose(out);
+}
+
+/* Looks the input up, and starts a new entry if it is not there */
+static void cache_open(struct cache *c,
+                       FILE *in,
+                       const struct options *o,
+                       int argc,
+                       char *argv[])
+{
+        long size = file_size(in);
+        struct hash64 samples, options;
+        char sample_hex[17], options_hex[17];
+        FILE *f;
+
+        memset(c, 0, sizeof(*c));
+        hash64_init(&c->input);
+        hash64_init(&samples);
+        hash64_init(&options);
+        cache_sample_hash(in, size, &samples);
+        cache_options_hash(o, argc, argv, &options);
+        c->key = xmalloc(strlen(o->cache_dir) + 64);
+        sprintf(c->key,
+                "%s/%08lx-%s-%s",
+                o->cache_dir,
+                (unsigned long)size,
+                hash64_format(&samples, sample_hex),
+                hash64_format(&options, options_hex));
+        c->path = cache_path(c, ".tsv");
+        f = fopen(c->path, "rb");
+        if (f) {
+                fclose(f);
+                c->hit = 1;
+        }
+        if (c->hit) {
+                char *hash_path = cache_path(c, ".hash");
+                FILE *hash = xfopen(hash_path, "r");
+                char stored[17], full_hex[17], identity[128], line_buf[128];
+                struct hash64 full;
+
+                if (fscanf(hash, "%16s ", stored) != 1) {
+                        error(err_wrong_cache_entry);
+                }
+                if (!fgets(line_buf, sizeof(line_buf), hash)) {
+                        *line_buf = '\0';
+                }
+                line_buf[strcspn(line_buf, "\n")] = '\0';
+                fclose(hash);
+                free(hash_path);
+                cache_file_identity(in, identity);
+                /* The sampled hash is trusted for the same file only */
+                if (o->cache_verify || strcmp(line_buf, identity)) {
+                        cache_full_hash(in, &full);
+                        hash64_format(&full, full_hex);
+                        c->hit = !strcmp(stored, full_hex);
+                }
+        }
+        if (!c->hit) {
+                char *tmp_path = cache_path(c, ".tsv.tmp");
+
+                c->output = xfopen(tmp_path, "wb");
+                free(tmp_path);
+        }
+}
+
+static void cache_copy(const struct cache *c, const struct options *o)
+{
+        FILE *in = xfopen(c->path, "rb");
+        char buf[16384];
+        size_t n;
+
+        while ((n = fread(buf, 1, sizeof(buf), in))) {
+                out_bytes(buf, n);
+                out_flush();
+        }
+        fclose(in);
+        if (o->state_path) {
+                char *state_path = cache_path(c, ".state");
+
+                copy_file(state_path, o->state_path);
+                free(state_path);
+        }
+}
+
+/*
+ * Completes the new entry once the run is over, with the hash of the lines
+ * converted, or of the whole input if the run did not read all of it
+ */
+static void
+cache_close(struct cache *c, FILE *in, const struct options *o, int whole)
+{
+        char *tmp_path = cache_path(c, ".tsv.tmp");
+        char *hash_path = cache_path(c, ".hash");
+        FILE *hash = xfopen(hash_path, "w");
+        char hex[17], identity[128];
+
+        out_flush();
+        output.tee = NULL;
+        xfclose(c->output);
+        if (!whole) {
+                cache_full_hash(in, &c->input);
+        }
+        cache_file_identity(in, identity);
+        fprintf(hash, "%s %s\n", hash64_format(&c->input, hex), identity);
+        xfclose(hash);
+        if (o->state_path) {
+                char *state_path = cache_path(c, ".state");
+
+                copy_file(o->state_path, state_path);
+                free(state_path);
+        }
+        remove(c->path);
+        if (rename(tmp_path, c->path)) {
+                error(err_output_write_error);
+        }
+        free(tmp_path);
+        free(hash_path);
+}
+
+static void add_column(struct options *o, int column)
+{
+        if (o->columns_count == MAX_COLUMNS) {
+                error(err_wrong_option_value);
+        }
+        o->columns[o->columns_count++] = column;
+        if (column == COLUMN_ERRORS) {
+                o->errors_used = 1;
+        } else if (column >= COLUMN_LOOKUP) {
+                o->lookups[column - COLUMN_LOOKUP].used = 1;
+        }
+}
+
+/* All columns by default, or just the listed ones if --columns is given */
+static void resolve_columns(struct options *o)
+{
+        char *spec = o->columns_spec ? xstrdup(o->columns_spec) : NULL;
+        char *name;
+        size_t i;
+        int f;
+
+        if (!spec) {
+                for (f = 0; f < FIELD_DURATION; f++) {
+                        add_column(o, f);
+                }
+                if (o->duration != DURATION_NONE) {
+                        add_column(o, FIELD_DURATION);
+                }
+                if (o->errors_path) {
+                        add_column(o, COLUMN_ERRORS);
+                }
+                for (i = 0; i < o->lookups_count; i++) {
+                        add_column(o, COLUMN_LOOKUP + (int)i);
+                }
+                return;
+        }
+        for (name = strtok(spec, ","); name; name = strtok(NULL, ",")) {
+                for (i = 0; i < o->lookups_count; i++) {
+                        if (!strcmp(o->lookups[i].name, name)) {
+                                break;
+                        }
+                }
+                if (i < o->lookups_count) {
+                        add_column(o, COLUMN_LOOKUP + (int)i);
+                } else if (!strcmp(name, "errors") && o->errors_path) {
+                        add_column(o, COLUMN_ERRORS);
+                } else if (!strcmp(name, "line")) {
+                        add_column(o, COLUMN_LINE);
+                } else {
+                        f = field_by_name(name);
+                        if (f == FIELD_DURATION
+                            && o->duration == DURATION_NONE) {
+                                error(err_missing_option_value);
+                        }
+                        add_column(o, f);
+                }
+        }
+        free(spec);
+}
+
+static void parse_args(int argc, char *argv[], struct options *o)
+{
+        int i, range = 0;
+
+        memset(o, 0, sizeof(*o));
+        o->error_window = 2;
+        o->range_end = -1;
+        o->bloom_fpr = 0.01;
+        o->cluster_window = DEFAULT_CLUSTER_WINDOW;
+
+        for (i = 1; i < argc; i++) {
+                const char *arg = argv[i];
+                const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+                if (arg[0] != '-' || arg[1] != '-') {
+                        error(err_too_many_args);
+                }
+                if (!strcmp(arg, "--stats")) {
+                        o->stats = 1;
+                        continue;
+                }
+                if (!strcmp(arg, "--strict-alloc")) {
+                        o->strict_alloc = 1;
+                        continue;
+                }
+                if (!strcmp(arg, "--sorted")) {
+                        o->sorted = 1;
+                        continue;
+                }
+                if (!strcmp(arg, "--trigrams")) {
+                        o->trigrams = 1;
+                        continue;
+                }
+                if (!strcmp(arg, "--encode")) {
+                        o->encode = 1;
+                        continue;
+                }
+                if (!strcmp(arg, "--cache-verify")) {
+                        o->cache_verify = 1;
+                        continue;
+                }
+                if (!value) {
+                        error(err_missing_option_value);
+                }
+                if (!strcmp(arg, "--duration")) {
+                        o->duration = parse_duration_format(value);
+                } else if (!strcmp(arg, "--latency")) {
+                        o->latency_path = value;
+                } else if (!strcmp(arg, "--state")) {
+                        o->state_path = value;
+                } else if (!strcmp(arg, "--rollup")) {
+                        o->rollup_dir = value;
+                } else if (!strcmp(arg, "--errors")) {
+                        o->errors_path = value;
+                } else if (!strcmp(arg, "--error-window")) {
+                        char *end = NULL;
+
+                        o->error_window = strtol(value, &end, 10);
+                        if (*end || o->error_window < 0) {
+                                error(err_wrong_option_value);
+                        }
+                } else if (!strcmp(arg, "--lookup")) {
+                        if (o->lookups_count == MAX_LOOKUPS) {
+                                error(err_too_many_lookups);
+                        }
+                        lookup_open(&o->lookups[o->lookups_count++], value);
+                } else if (!strcmp(arg, "--output-chunk")) {
+                        const char *end = NULL;
+                        long chunk = parse_offset(value, &end);
+
+                        if (*end || !chunk) {
+                                error(err_wrong_option_value);
+                        }
+                        output.chunk = (size_t)chunk;
+                } else if (!strcmp(arg, "--input-buffer")) {
+                        const char *end = NULL;
+                        long size = parse_offset(value, &end);
+
+                        if (*end || !size) {
+                                error(err_wrong_option_value);
+                        }
+                        o->input_buffer = (size_t)size;
+                } else if (!strcmp(arg, "--drop-behind")) {
+                        const char *end = NULL;
+                        long size = parse_offset(value, &end);
+
+                        if (*end || !size) {
+                                error(err_wrong_option_value);
+                        }
+                        o->drop_behind = (size_t)size;
+                        output.drop_behind = (unsigned long)size;
+                } else if (!strcmp(arg, "--contains")) {
+                        if (o->literals_count == MAX_LITERALS) {
+                                error(err_too_many_literals);
+                        }
+                        if (!*value) {
+                                error(err_wrong_option_value);
+                        }
+                        o->literals[o->literals_count++] = value;
+                } else if (!strcmp(arg, "--where")) {
+                        if (o->filters_count == MAX_FILTERS) {
+                                error(err_too_many_filters);
+                        }
+                        parse_filter(value, &o->filters[o->filters_count++]);
+                } else if (!strcmp(arg, "--from")) {
+                        o->from = parse_iso_datetime(value);
+                        o->has_from = 1;
+                } else if (!strcmp(arg, "--to")) {
+                        o->to = parse_iso_datetime(value);
+                        o->has_to = 1;
+                } else if (!strcmp(arg, "--columnar")) {
+                        o->columnar_prefix = value;
+                } else if (!strcmp(arg, "--cluster")) {
+                        char *spec = xstrdup(value);
+                        char *name;
+
+                        for (name = strtok(spec, ","); name;
+                             name = strtok(NULL, ",")) {
+                                if (o->cluster_count == MAX_COLUMNS) {
+                                        error(err_wrong_option_value);
+                                }
+                                o->cluster_fields[o->cluster_count++] =
+                                    field_by_name(name);
+                        }
+                        free(spec);
+                } else if (!strcmp(arg, "--cluster-window")) {
+                        char *end = NULL;
+
+                        o->cluster_window = strtoul(value, &end, 10);
+                        if (*end || !o->cluster_window) {
+                                error(err_wrong_option_value);
+                        }
+                } else if (!strcmp(arg, "--dictionary")) {
+                        o->dictionary_path = value;
+                } else if (!strcmp(arg, "--cache")) {
+                        o->cache_dir = value;
+                } else if (!strcmp(arg, "--inputs")) {
+                        o->inputs_path = value;
+                } else if (!strcmp(arg, "--inputs-match")) {
+                        o->inputs_match = value;
+#ifdef POSIX_2001
+                } else if (!strcmp(arg, "--dir")) {
+                        o->inputs_dir = value;
+                } else if (!strcmp(arg, "--modified-since")) {
+                        o->modified_since = parse_iso_datetime(value);
+                        o->has_modified_since = 1;
+#endif
+                } else if (!strcmp(arg, "--bloom")) {
+                        o->bloom_path = value;
+                } else if (!strcmp(arg, "--bloom-fpr")) {
+                        char *end = NULL;
+
+                        o->bloom_fpr = strtod(value, &end);
+                        if (*end || o->bloom_fpr <= 0 || o->bloom_fpr >= 1) {
+                                error(err_wrong_option_value);
+                        }
+                } else if (!strcmp(arg, "--bloom-size")) {
+                        const char *end = NULL;
+
+                        o->bloom_size =
+                            (unsigned long)parse_offset(value, &end);
+                        if (*end) {
+                                error(err_wrong_option_value);
+                        }
+                } else if (!strcmp(arg, "--records")) {
+                        o->records_path = value;
+                } else if (!strcmp(arg, "--columns")) {
+                        o->columns_spec = value;
+                } else if (!strcmp(arg, "--input")) {
+                        o->input_path = value;
+                } else if (!strcmp(arg, "--range")) {
+                        parse_range(value, &o->range_start, &o->range_end);
+                        range = 1;
+                } else {
+                        error(err_unknown_option);
+                }
+                i++;
+        }
+        if ((o->latency_path || o->state_path || o->rollup_dir)
+            && o->duration == DURATION_NONE) {
+                error(err_missing_option_value);
+        }
+        /* Checkpoints decide where a rollup run starts */
+        if (o->rollup_dir && range) {
+                error(err_wrong_option_value);
+        }
+        if ((o->rollup_dir && !o->input_path)
+            || ((o->trigrams || o->encode || o->dictionary_path)
+                && !o->columnar_prefix)) {
+                error(err_missing_option_value);
+        }
+        if (o->cluster_count && o->columnar_prefix) {
+                error(err_wrong_option_value);
+        }
+        /* Lines have no duration to cluster by without --duration */
+        for (i = 0; i < (int)o->cluster_count; i++) {
+                if (o->cluster_fields[i] == FIELD_DURATION
+                    && o->duration == DURATION_NONE) {
+                        error(err_wrong_option_value);
+                }
+        }
+        /* Offsets, checkpoints and cache keys are of a single input */
+        if ((o->inputs_path || o->inputs_dir)
+            && (o->input_path || o->range_start || o->range_end >= 0
+                || o->sorted || o->rollup_dir || o->cache_dir)) {
+                error(err_wrong_option_value);
+        }
+        if ((o->inputs_path && o->inputs_dir)
+            || (o->has_modified_since && !o->inputs_path && !o->inputs_dir)) {
+                error(err_wrong_option_value);
+        }
+        /* Cached are standard output and state only */
+        if (o->cache_dir
+            && (!o->input_path || o->columnar_prefix || o->records_path
+                || o->latency_path || o->rollup_dir || o->bloom_path)) {
+                error(err_wrong_option_value);
+        }
+        resolve_columns(o);
+        if (o->cluster_count) {
+                /* Explicit columns may leave out line, if order is lost */
+                if (!o->columns_spec) {
+                        add_column(o, COLUMN_LINE);
+                }
+                output.hold = 1;
+        }
+}
+
+/* Lines after which the loop is expected to run without heap allocations */
+#define WARMUP_LINES 1024
+
+struct stats {
+        unsigned long lines;
+        long input_bytes;
+        clock_t started;
+        unsigned long warm_allocations;
+        unsigned long steady_allocations;
+};
+
+/*
+ * NUMA nodes.  The converter is a single thread with no workers to place, so
+ * a run is placed as a whole with numactl, and its buffers are then local as
+ * Linux allocates pages on the node which first touches them.  POSIX builds
+ * read the topology from sysfs and sample the processor the thread runs on
+ * every NODE_SAMPLE_LINES lines, and --stats reports the lines, wall time and
+ * throughput spent on each node.  Pinning from inside would take
+ * sched_setaffinity(), which is not POSIX.
+ */
+
+#define MAX_NODES 16
+#define MAX_CPUS 1024
+#define NODE_SAMPLE_LINES 65536
+
+struct nodes {
+        int count; /* 0 if the topology is not known */
+#ifdef POSIX_2001
+        signed char cpu_node[MAX_CPUS]; /* -1 for processors of no node */
+        struct timespec started;
+        struct timespec sampled;
+        unsigned long sampled_lines;
+        long sampled_bytes;
+        unsigned long lines[MAX_NODES];
+        long input_bytes[MAX_NODES];
+        double seconds[MAX_NODES];
+#endif
+};
+
+#ifdef POSIX_2001
+static double seconds_between(const struct timespec *a,
+                              const struct timespec *b)
+{
+        return (double)(b->tv_sec - a->tv_sec)
+               + (double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* Processor the thread last ran on, field 39 of /proc/self/stat, or -1 */
+static int current_cpu(void)
+{
+        FILE *in = fopen("/proc/self/stat", "r");
+        char line_buf[1024];
+        const char *s = NULL;
+        int field;
+
+        if (in) {
+                s = fgets(line_buf, sizeof(line_buf), in);
+                fclose(in);
+        }
+        /* The command name in field 2 may have spaces, but not ") " */
+        if (!s || !(s = strrchr(line_buf, ')'))) {
+                return -1;
+        }
+        for (field = 2; field < 39 && s; field++) {
+                s = strchr(s + 1, ' ');
+        }
+        return s ? atoi(s + 1) : -1;
+}
+#endif
+
+static void nodes_open(struct nodes *n)
+{
+#ifdef POSIX_2001
+        char path[64];
+        char list_buf[1024];
+        int node;
+
+        memset(n, 0, sizeof(*n));
+        memset(n->cpu_node, -1, sizeof(n->cpu_node));
+        for (node = 0; node < MAX_NODES; node++) {
+                FILE *in;
+                char *s = list_buf;
+
+                sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+                if (!(in = fopen(path, "r"))) {
+                        continue;
+                }
+                if (!fgets(list_buf, sizeof(list_buf), in)) {
+                        list_buf[0] = '\0';
+                }
+                fclose(in);
+                /* Ranges such as 0-3,8-11 */
+                while (isdigit((unsigned char)*s)) {
+                        long first = strtol(s, &s, 10), last = first;
+
+                        if (*s == '-') {
+                                last = strtol(s + 1, &s, 10);
+                        }
+                        for (; first <= last && first < MAX_CPUS; first++) {
+                                n->cpu_node[first] = (signed char)node;
+                        }
+                        if (*s == ',') {
+                                s++;
+                        }
+                }
+                n->count = node + 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &n->started);
+        n->sampled = n->started;
+#else
+        n->count = 0;
+#endif
+}
+
+/* Attributes the lines since the last sample to the node running now */
+static void nodes_sample(struct nodes *n, const struct stats *st)
+{
+#ifdef POSIX_2001
+        struct timespec now;
+        int cpu = current_cpu();
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (cpu >= 0 && cpu < MAX_CPUS && n->cpu_node[cpu] >= 0) {
+                int node = n->cpu_node[cpu];
+
+                n->lines[node] += st->lines - n->sampled_lines;
+                n->input_bytes[node] += st->input_bytes - n->sampled_bytes;
+                n->seconds[node] += seconds_between(&n->sampled, &now);
+        }
+        n->sampled = now;
+        n->sampled_lines = st->lines;
+        n->sampled_bytes = st->input_bytes;
+#else
+        (void)n;
+        (void)st;
+#endif
+}
+
+static void print_node_stats(const struct nodes *n)
+{
+#ifdef POSIX_2001
+        struct timespec now;
+        double seconds;
+        int node;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = seconds_between(&n->started, &now);
+        fprintf(stderr, "wall_seconds\t%.3f\n", seconds);
+        if (seconds > 0) {
+                fprintf(stderr,
+                        "input_mb_per_wall_second\t%.1f\n",
+                        (double)n->sampled_bytes / seconds / 1e6);
+        }
+        fprintf(stderr, "nodes\t%d\n", n->count);
+        for (node = 0; node < n->count; node++) {
+                if (!n->lines[node]) {
+                        continue;
+                }
+                fprintf(stderr, "node%d_lines\t%lu\n", node, n->lines[node]);
+                fprintf(stderr,
+                        "node%d_wall_seconds\t%.3f\n",
+                        node,
+                        n->seconds[node]);
+                if (n->seconds[node] > 0) {
+                        fprintf(stderr,
+                                "node%d_input_mb_per_wall_second\t%.1f\n",
+                                node,
+                                (double)n->input_bytes[node] / n->seconds[node]
+                                    / 1e6);
+                }
+        }
+#else
+        (void)n;
+#endif
+}
+
+#ifdef MADV_HUGEPAGE
+/* Memory of the process backed by huge pages, as far as Linux tells */
+static unsigned long huge_page_resident(void)
+{
+        FILE *in = fopen("/proc/self/smaps_rollup", "r");
+        char line_buf[256];
+        unsigned long kb = 0;
+
+        if (!in) {
+                return 0;
+        }
+        while (fgets(line_buf, sizeof(line_buf), in)) {
+                if (sscanf(line_buf, "AnonHugePages: %lu kB", &kb) == 1) {
+                        break;
+                }
+        }
+        fclose(in);
+        return kb * 1024;
+}
+#endif
+
+static void print_stats(const struct stats *st,
+                        const struct nodes *nodes,
+                        const struct options *o,
+                        const struct map *latency)
+{
+        double seconds = (double)(clock() - st->started) / CLOCKS_PER_SEC;
+
+        fprintf(stderr, "lines\t%lu\n", st->lines);
+        fprintf(stderr, "input_bytes\t%ld\n", st->input_bytes);
+        fprintf(stderr, "output_bytes\t%lu\n", output.written);
+        fprintf(stderr,
+                "input_buffer\t%lu\n",
+                (unsigned long)(o->input_buffer ? o->input_buffer : BUFSIZ));
+        fprintf(stderr, "output_buffer\t%lu\n", (unsigned long)output.cap);
+        fprintf(stderr, "huge_pages_advised\t%lu\n", huge_page_advised);
+#ifdef MADV_HUGEPAGE
+        fprintf(stderr, "huge_pages_resident\t%lu\n", huge_page_resident());
+#endif
+        fprintf(stderr, "aggregates\t%lu\n", (unsigned long)latency->len);
+        fprintf(stderr,
+                "aggregate_bytes\t%lu\n",
+                (unsigned long)(latency->len * sizeof(struct histogram)
+                                + latency->cap * sizeof(struct map_entry)));
+        fprintf(stderr, "allocations\t%lu\n", allocations);
+        fprintf(stderr,
+                "steady_allocations\t%lu\n",
+                st->steady_allocations);
+        fprintf(stderr, "cpu_seconds\t%.3f\n", seconds);
+        if (seconds > 0) {
+                fprintf(stderr,
+                        "lines_per_second\t%.0f\n",
+                        (double)st->lines / seconds);
+                fprintf(stderr,
+                        "input_mb_per_second\t%.1f\n",
+                        (double)st->input_bytes / seconds / 1e6);
+        }
+        print_node_stats(nodes);
+}
+
+int main(int argc, char *argv[])
+{
+        char in_buf[4096] = {0};
+        char key_buf[sizeof(in_buf) + 64] = {0};
+        struct options opts;
+        struct record rec;
+        struct map latency = {NULL, 0, 0};
+        struct map bloom_keys = {NULL, 0, 0};
+        struct error_log errors;
+        struct columnar columnar;
+        struct cache cache;
+        struct inputs inputs = {NULL, 0, 0, 0, 0};
+        FILE *in = stdin;
+        FILE *records = NULL;
+        struct stats st = {0, 0, 0, 0, 0};
+        struct nodes nodes;
+        struct arena scratch = {NULL, 0, 0, NULL, 0};
+        long start, pos, dropped;
+        size_t i, len;
+
+        if (argc > 1 && argv[1][0] != '-') {
+                if (!strcmp(argv[1], "build-lookup")) {
+                        if (argc != 4) {
+                                error(err_too_many_args);
+                        }
+                        lookup_build(argv[2], argv[3]);
+                        return EXIT_SUCCESS;
+                }
+                if (!strcmp(argv[1], "records")) {
+                        if (argc != 3) {
+                                error(err_too_many_args);
+                        }
+                        records_command(argv[2]);
+                        return EXIT_SUCCESS;
+                }
+                if (!strcmp(argv[1], "bloom-check")) {
+                        bloom_check_command(argc, argv);
+                        return EXIT_SUCCESS;
+                }
+                if (!strcmp(argv[1], "replay")) {
+                        replay_command(argc, argv);
+                        return EXIT_SUCCESS;
+                }
+                if (!strcmp(argv[1], "search")) {
+                        search_command(argc, argv);
+                        return EXIT_SUCCESS;
+                }
+                if (!strcmp(argv[1], "query")) {
+                        query_command(argc, argv);
+                        return EXIT_SUCCESS;
+                }
+                if (!strcmp(argv[1], "merge")) {
+                        merge_command(argc, argv);
+                        return EXIT_SUCCESS;
+                }
+                if (!strcmp(argv[1], "manifest")) {
+                        const char *end = NULL;
+                        long n;
+
+                        if (argc != 4) {
+                                error(err_too_many_args);
+                        }
+                        n = parse_offset(argv[2], &end);
+                        if (*end || !n) {
+                                error(err_wrong_option_value);
+                        }
+                        print_manifest(argv[3], n);
+                        return EXIT_SUCCESS;
+                }
+                error(err_unknown_command);
+        }
+
+        st.started = clock();
+        parse_args(argc, argv, &opts);
+        if (opts.stats) {
+                nodes_open(&nodes);
+        }
+        if (opts.errors_path) {
+                error_log_open(&errors, opts.errors_path, opts.error_window);
+        }
+        if (opts.input_path) {
+                in = xfopen(opts.input_path, "rb");
+        }
+        if (opts.inputs_path || opts.inputs_dir) {
+                inputs_open(&inputs, &opts);
+                in = inputs.count ? xfopen(inputs.files[0].path, "rb") : NULL;
+                inputs.next = 1;
+        }
+        if (in) {
+                input_set_buffer(in, opts.input_buffer);
+        }
+        if (in && opts.drop_behind) {
+                input_advise(in);
+        }
+        if (opts.cache_dir) {
+                cache_open(&cache, in, &opts, argc, argv);
+                if (cache.hit) {
+                        cache_copy(&cache, &opts);
+                        out_finish();
+                        return EXIT_SUCCESS;
+                }
+                output.tee = cache.output;
+        }
+        if (opts.rollup_dir) {
+                opts.range_start =
+                    rollup_checkpoint(opts.rollup_dir, opts.input_path, in);
+        }
+        start = opts.range_start;
+        if (opts.sorted && opts.has_from) {
+                long found = find_time(in, start, opts.from, &opts);
+
+                start = found > start ? found : start;
+                if (!start) {
+                        rewind(in);
+                }
+        }
+        seek_to_line(in, start);
+        pos = start ? ftell(in) : 0;
+        dropped = pos;
+        if (opts.records_path) {
+                records = xfopen(opts.records_path, "wb");
+                records_open(records);
+        }
+        if (opts.columnar_prefix) {
+                columnar_open_all(&columnar, opts.columnar_prefix, &opts);
+        } else if (!opts.range_start) {
+                print_header(&opts);
+        }
+
+        while ((opts.range_end < 0 || pos < opts.range_end)
+               && inputs_read_line(&inputs, in_buf, sizeof(in_buf), &in)) {
+                if (!memchr(in_buf, '\n', sizeof(in_buf))) {
+                        error(err_line_is_too_long);
+                }
+                len = strlen(in_buf);
+                pos += (long)len;
+                st.input_bytes += (long)len;
+                if (opts.cache_dir) {
+                        hash64_update(&cache.input, in_buf, len);
+                }
+                st.lines++;
+                if (opts.drop_behind
+                    && pos - dropped >= (long)opts.drop_behind) {
+                        input_drop(in, 0);
+                        dropped = pos;
+                }
+                if (st.lines == WARMUP_LINES + 1) {
+                        st.warm_allocations = allocations;
+                }
+                if (opts.stats && !(st.lines % NODE_SAMPLE_LINES)) {
+                        nodes_sample(&nodes, &st);
+                }
+                arena_reset(&scratch);
+
+                if (opts.literals_count && !contains_any(in_buf, len, &opts)) {
+                        continue;
+                }
+                if (*in_buf == '\n') {
+                        if (!opts.columnar_prefix && !opts.cluster_count) {
+                                out_end_line();
+                        }
+                        continue;
+                }
+
+                parse_line(in_buf, &opts, &rec);
+                rec.line = st.lines;
+                if (!record_matches(&rec, &opts)) {
+                        if (opts.sorted && opts.has_to
+                            && tm_to_seconds(&rec.time) >= opts.to) {
+                                break;
+                        }
+                        continue;
+                }
+                if (opts.errors_used) {
+                        error_log_join(&errors, &rec, &scratch);
+                }
+                for (i = 0; i < opts.lookups_count; i++) {
+                        if (!opts.lookups[i].used) {
+                                continue;
+                        }
+                        lookup_join(&opts.lookups[i], &rec, &rec.lookups[i]);
+                }
+                if (records) {
+                        records_write(records, in_buf, &rec);
+                }
+                if (opts.columnar_prefix) {
+                        columnar_write(&columnar, &rec, &opts);
+                } else if (opts.cluster_count) {
+                        cluster_add(&rec, &opts);
+                } else {
+                        print_record(&rec, &opts);
+                }
+                if (opts.latency_path || opts.state_path || opts.rollup_dir) {
+                        latency_add(&latency, &rec, key_buf);
+                }
+                if (opts.bloom_path) {
+                        bloom_add_key(&bloom_keys,
+                                      "host",
+                                      rec.fields[FIELD_HOST]);
+                        bloom_add_key(&bloom_keys,
+                                      "path",
+                                      request_path(&rec));
+                }
+        }
+
+        if (in && ferror(in)) {
+                error(err_input_read_error);
+        }
+        if (st.lines > WARMUP_LINES) {
+                st.steady_allocations = allocations - st.warm_allocations;
+        }
+        if (opts.strict_alloc && st.steady_allocations) {
+                error(err_steady_state_allocation);
+        }
+        if (cluster.len) {
+                cluster_flush();
+        }
+        if (opts.columnar_prefix) {
+                columnar_close(&columnar, &opts);
+        }
+        if (records) {
+                xfclose(records);
+        }
+        if (opts.bloom_path) {
+                bloom_write(&bloom_keys,
+                            opts.bloom_path,
+                            opts.bloom_fpr,
+                            opts.bloom_size);
+        }
+        if (opts.latency_path) {
+                FILE *out = xfopen(opts.latency_path, "w");
+
+                latency_write_summary(&latency, out);
+                xfclose(out);
+        }
+        if (opts.state_path) {
+                state_write(&latency, opts.state_path);
+        }
+        if (opts.rollup_dir) {
+                rollup_update(opts.rollup_dir,
+                              &latency,
+                              opts.input_path,
+                              in,
+                              pos);
+        }
+        if (opts.cache_dir) {
+                cache_close(&cache, in, &opts, !start && feof(in));
+        }
+        if (in && opts.drop_behind) {
+                input_drop(in, 1);
+        }
+        out_finish();
+        if (opts.stats) {
+                nodes_sample(&nodes, &st);
+                print_stats(&st, &nodes, &opts, &latency);
         }
 
         return EXIT_SUCCESS;